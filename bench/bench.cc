@@ -0,0 +1,380 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#include <functional>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <cmath>
+
+#include <getopt.h>
+#include <time.h>
+
+#include "classifier.h"
+#include "counters.h"
+#include "filelist.h"
+#include "filetree.h"
+#include "hash.h"
+
+/*
+ * Microbenchmarks for the per-file kernels. Every benchmark runs over the
+ * same set of generated files a number of times and reports the median,
+ * along with the spread of the runs. The generated files have known line
+ * counts, so the counters are checked for correctness on the way.
+ */
+
+#define BENCH_FILE_SIZE		(8 * 1024)
+#define BENCH_NAMES		(64 * 1024)
+
+struct bench_options {
+	unsigned reps = 15;
+	size_t size = 16 * 1024 * 1024;	// Bytes of source per language
+	unsigned comments = 20;		// Percent of lines
+	unsigned blanks = 15;		// Percent of lines
+	const char *filter = nullptr;
+};
+
+struct bench_file {
+	std::string data;
+	uint64_t code;
+	uint64_t comment;
+	uint64_t whitespace;
+};
+
+// How a language writes comments which span a single line
+struct bench_lang {
+	const char *name;
+	void (*count)(struct file_result &r, const char *buffer, size_t size);
+	const char *comment_start;
+	const char *comment_end;
+};
+
+static const struct bench_lang langs[] = {
+	{ "count_c",		count_c,	"// ",		""	},
+	{ "count_asm",		count_asm,	"# ",		""	},
+	{ "count_python",	count_python,	"# ",		""	},
+	{ "count_perl",		count_perl,	"# ",		""	},
+	{ "count_xml",		count_xml,	"<!-- ",	" -->"	},
+	{ "count_shell",	count_shell,	"# ",		""	},
+	{ "count_latex",	count_latex,	"% ",		""	},
+	{ "count_text",		count_text,	nullptr,	nullptr	},
+	{ "count_asn1",		count_asn1,	"-- ",		""	},
+	{ "count_rust",		count_rust,	"// ",		""	},
+	{ "count_css",		count_css,	"/* ",		" */"	},
+	{ "count_ruby",		count_ruby,	"# ",		""	},
+};
+
+static const char *const words[] = {
+	"value", "buffer", "index", "count", "result", "state", "next", "size",
+	"return", "if", "else", "for", "while", "node", "entry", "list",
+};
+
+// xorshift64, the inputs only have to be the same on every run
+static uint64_t bench_rand(uint64_t &state)
+{
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+
+	return state;
+}
+
+static void append_words(std::string &s, uint64_t &rnd)
+{
+	unsigned nr = 2 + bench_rand(rnd) % 8;
+
+	for (unsigned i = 0; i < nr; ++i) {
+		if (i != 0)
+			s += ' ';
+		s += words[bench_rand(rnd) % (sizeof(words) / sizeof(words[0]))];
+	}
+}
+
+static struct bench_file generate_file(const struct bench_lang &lang,
+				       const struct bench_options &opts, uint64_t &rnd)
+{
+	struct bench_file f = { std::string(), 0, 0, 0 };
+	unsigned comments = lang.comment_start != nullptr ? opts.comments : 0;
+
+	while (f.data.size() < BENCH_FILE_SIZE) {
+		unsigned p = bench_rand(rnd) % 100;
+
+		if (p < opts.blanks) {
+			// An empty first line is not counted, see finish_line()
+			if ((bench_rand(rnd) & 1) || f.data.empty())
+				f.data += '\t';
+			f.data += '\n';
+			f.whitespace += 1;
+		} else if (p < opts.blanks + comments) {
+			f.data += lang.comment_start;
+			append_words(f.data, rnd);
+			f.data += lang.comment_end;
+			f.data += '\n';
+			f.comment += 1;
+		} else {
+			f.data += "\t";
+			append_words(f.data, rnd);
+			f.data += ";\n";
+			f.code += 1;
+		}
+	}
+
+	return f;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Runs 'fn' opts.reps times after one warm-up run and prints the median
+ * throughput and time per item, plus the relative standard deviation.
+ */
+static void run(const char *name, const struct bench_options &opts,
+		uint64_t bytes, uint64_t items, const std::function<void(void)> &fn)
+{
+	std::vector<double> times;
+	double mean = 0, var = 0, median;
+
+	if (opts.filter != nullptr && strstr(name, opts.filter) == nullptr)
+		return;
+
+	fn();
+
+	for (unsigned i = 0; i < opts.reps; ++i) {
+		uint64_t start = now_ns();
+
+		fn();
+		times.push_back(now_ns() - start);
+	}
+
+	for (auto t : times)
+		mean += t;
+	mean /= times.size();
+
+	for (auto t : times)
+		var += (t - mean) * (t - mean);
+	var /= times.size();
+
+	std::sort(times.begin(), times.end());
+	median = times[times.size() / 2];
+
+	std::cout << std::left << std::setw(24) << name << std::right << std::fixed;
+	std::cout << std::setprecision(1);
+	if (bytes != 0)
+		std::cout << std::setw(12) << bytes / median * 1e9 / (1024 * 1024);
+	else
+		std::cout << std::setw(12) << "-";
+	std::cout << std::setw(12) << median / items;
+	std::cout << std::setw(9) << std::sqrt(var) / mean * 100 << std::endl;
+}
+
+static bool bench_counters(const struct bench_options &opts)
+{
+	bool ok = true;
+
+	for (auto &lang : langs) {
+		std::vector<struct bench_file> files;
+		uint64_t rnd = 0x9e3779b97f4a7c15ULL;
+		uint64_t bytes = 0;
+
+		while (bytes < opts.size) {
+			files.push_back(generate_file(lang, opts, rnd));
+			bytes += files.back().data.size();
+		}
+
+		for (auto &f : files) {
+			file_result r("bench");
+
+			lang.count(r, f.data.data(), f.data.size());
+
+			if (r.code != f.code || r.comment != f.comment || r.whitespace != f.whitespace) {
+				std::cerr << lang.name << ": counted " << r.code << '/' << r.comment
+					  << '/' << r.whitespace << " lines, expected " << f.code
+					  << '/' << f.comment << '/' << f.whitespace << std::endl;
+				ok = false;
+				break;
+			}
+		}
+
+		run(lang.name, opts, bytes, files.size(), [&files, &lang] {
+			for (auto &f : files) {
+				file_result r("bench");
+
+				lang.count(r, f.data.data(), f.data.size());
+			}
+		});
+	}
+
+	return ok;
+}
+
+static void bench_hashes(const struct bench_options &opts)
+{
+	std::vector<struct bench_file> files;
+	uint64_t rnd = 0x2545f4914f6cdd1dULL;
+	uint64_t bytes = 0;
+	volatile uint64_t sink = 0;
+
+	while (bytes < opts.size) {
+		files.push_back(generate_file(langs[0], opts, rnd));
+		bytes += files.back().data.size();
+	}
+
+	run("hash_content/murmur3", opts, bytes, files.size(), [&] {
+		for (auto &f : files)
+			sink = sink + hash_content(hash_algo::murmur3, f.data.data(), f.data.size()).lo;
+	});
+
+	run("hash_content/md4", opts, bytes, files.size(), [&] {
+		for (auto &f : files)
+			sink = sink + hash_content(hash_algo::md4, f.data.data(), f.data.size()).lo;
+	});
+}
+
+// Paths spread over a few hundred directories, with common and rare names
+static std::vector<std::string> generate_paths(void)
+{
+	static const char *const names[] = {
+		".c", ".h", ".py", ".pl", ".S", ".rs", ".txt", ".json", ".xyz", ".o",
+		"Makefile", "Kconfig", "README", "",
+	};
+	std::vector<std::string> paths;
+	uint64_t rnd = 0x5851f42d4c957f2dULL;
+
+	for (unsigned i = 0; i < BENCH_NAMES; ++i) {
+		std::string p = "dir" + std::to_string(bench_rand(rnd) % 16) + "/sub" +
+				std::to_string(bench_rand(rnd) % 32) + "/";
+		const char *n = names[bench_rand(rnd) % (sizeof(names) / sizeof(names[0]))];
+
+		if (n[0] == '.' || n[0] == 0)
+			p += "file" + std::to_string(i) + n;
+		else
+			p += n;
+
+		paths.push_back(p);
+	}
+
+	return paths;
+}
+
+static void bench_results(const struct bench_options &opts)
+{
+	std::vector<std::string> paths = generate_paths();
+	std::vector<struct file_result> results;
+	volatile size_t sink = 0;
+
+	for (auto &p : paths) {
+		results.emplace_back(p);
+		results.back().type = classifile(p);
+		results.back().code = p.size();
+	}
+
+	run("classifile", opts, 0, paths.size(), [&] {
+		for (auto &p : paths)
+			sink = sink + static_cast<size_t>(classifile(p));
+	});
+
+	run("file_list::add", opts, 0, results.size(), [&] {
+		file_list fl;
+
+		for (auto &r : results)
+			fl.add(r, std::string_view());
+		sink = sink + fl.size();
+	});
+
+	run("type_summary::add", opts, 0, results.size(), [&] {
+		type_summary sum;
+
+		for (auto &r : results)
+			sum.add(r, std::string_view());
+		sink = sink + sum.types();
+	});
+}
+
+static void usage(void)
+{
+	std::cout << "flocc-bench [options] [filter]" << std::endl;
+	std::cout << "Options:" << std::endl;
+	std::cout << "  --reps <n>         Measure every benchmark <n> times (default 15)" << std::endl;
+	std::cout << "  --size <MiB>       Generate <MiB> of source per language (default 16)" << std::endl;
+	std::cout << "  --comments <pct>   Make <pct> percent of the lines comments (default 20)" << std::endl;
+	std::cout << "  --blanks <pct>     Make <pct> percent of the lines blank (default 15)" << std::endl;
+	std::cout << "Only benchmarks with [filter] in their name are run." << std::endl;
+}
+
+static struct option options[] = {
+	{ "help",		no_argument,		0, 'h' },
+	{ "reps",		required_argument,	0, 'r' },
+	{ "size",		required_argument,	0, 's' },
+	{ "comments",		required_argument,	0, 'c' },
+	{ "blanks",		required_argument,	0, 'b' },
+	{ 0,			0,			0, 0   },
+};
+
+int main(int argc, char **argv)
+{
+	struct bench_options opts;
+
+	while (true) {
+		int c, optidx;
+
+		c = getopt_long(argc, argv, "h", options, &optidx);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			usage();
+			return 0;
+		case 'r':
+			opts.reps = strtoul(optarg, nullptr, 10);
+			break;
+		case 's':
+			opts.size = strtoul(optarg, nullptr, 10) * 1024 * 1024;
+			break;
+		case 'c':
+			opts.comments = strtoul(optarg, nullptr, 10);
+			break;
+		case 'b':
+			opts.blanks = strtoul(optarg, nullptr, 10);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (optind < argc)
+		opts.filter = argv[optind];
+
+	if (opts.reps == 0 || opts.size == 0 || opts.comments + opts.blanks > 100) {
+		std::cerr << "Invalid options" << std::endl;
+		return 1;
+	}
+
+	std::cout << std::left << std::setw(24) << "Benchmark" << std::right;
+	std::cout << std::setw(12) << "MiB/s" << std::setw(12) << "ns/item";
+	std::cout << std::setw(9) << "+-%" << std::endl;
+
+	bool ok = bench_counters(opts);
+	bench_hashes(opts);
+	bench_results(opts);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,452 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <ctime>
+
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "cache.h"
+#include "counters.h"
+#include "lang.h"
+
+#define CACHE_MAGIC	"FLOCCFS2"
+#define BLOB_MAGIC	"FLOCCGT1"
+
+/*
+ * Files modified this close to the start of the run might change again
+ * within the same mtime tick, so they are not cached.
+ */
+#define RACY_NS		(2ULL * 1000 * 1000 * 1000)
+
+struct cache_header {
+	char magic[8];
+	content_hash fingerprint;
+	uint64_t entries;
+};
+
+struct cache_record {
+	struct file_stamp stamp;
+	content_hash hash;
+	uint32_t type;
+	uint32_t code;
+	uint32_t comment;
+	uint32_t whitespace;
+	uint32_t hashed;
+	uint32_t path_len;
+};
+
+// Both cache files store 32 bit counts, larger results are not cached
+static bool counts_fit(uint64_t code, uint64_t comment, uint64_t whitespace)
+{
+	return code <= UINT32_MAX && comment <= UINT32_MAX && whitespace <= UINT32_MAX;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static content_hash rules_fingerprint(hash_algo algo)
+{
+	std::string sig = "counter " + std::to_string(COUNTER_VERSION);
+	const char *name;
+
+	sig += " hash " + std::to_string(static_cast<unsigned>(algo));
+
+	for (unsigned t = 0; (name = get_file_type_cstr(static_cast<file_type>(t))) != nullptr; ++t) {
+		sig += ' ';
+		sig += name;
+	}
+
+	sig += lang_signature();
+
+	return hash_content(hash_algo::murmur3, sig.data(), sig.size());
+}
+
+// Writes a new file and renames it over the old one
+bool write_atomic(const std::string &path, const std::string &data)
+{
+	std::string tmp = path + ".tmp." + std::to_string(getpid());
+	size_t done = 0;
+	int fd;
+
+	fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		std::cerr << "Can't create " << tmp << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	while (done < data.size()) {
+		ssize_t ret = write(fd, data.data() + done, data.size() - done);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0) {
+			std::cerr << "Can't write " << tmp << ": " << strerror(errno) << std::endl;
+			close(fd);
+			unlink(tmp.c_str());
+			return false;
+		}
+
+		done += ret;
+	}
+
+	if (fsync(fd) < 0 || close(fd) < 0 || rename(tmp.c_str(), path.c_str()) < 0) {
+		std::cerr << "Can't update " << path << ": " << strerror(errno) << std::endl;
+		unlink(tmp.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+result_cache::result_cache()
+	: m_fingerprint { 0, 0 }, m_start_ns(now_ns())
+{
+}
+
+/*
+ * A missing cache file or one written with other counting rules is not an
+ * error, the cache just starts out empty then.
+ */
+bool result_cache::load(const char *path, hash_algo algo)
+{
+	std::ifstream is(path, std::ios::binary | std::ios::ate);
+	struct cache_header hdr;
+	struct cache_record rec;
+	std::string name;
+	uint64_t remain;
+
+	m_path        = path;
+	m_fingerprint = rules_fingerprint(algo);
+
+	if (!is.is_open())
+		return true;
+
+	remain = is.tellg();
+	is.seekg(0);
+
+	if (remain < sizeof(hdr) || !is.read(reinterpret_cast<char *>(&hdr), sizeof(hdr)))
+		return true;
+
+	if (memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    !(hdr.fingerprint == m_fingerprint))
+		return true;
+
+	// Sizes are checked against the file, so a damaged one can't exhaust memory
+	remain -= sizeof(hdr);
+	if (hdr.entries <= remain / sizeof(rec))
+		m_entries.reserve(hdr.entries);
+
+	for (uint64_t i = 0; i < hdr.entries; ++i) {
+		if (remain < sizeof(rec) || !is.read(reinterpret_cast<char *>(&rec), sizeof(rec)))
+			break;
+
+		remain -= sizeof(rec);
+		if (rec.path_len > remain)
+			break;
+
+		remain -= rec.path_len;
+		name.resize(rec.path_len);
+		if (!is.read(&name[0], rec.path_len))
+			break;
+
+		struct cache_entry &e = m_entries[name];
+
+		e.stamp      = rec.stamp;
+		e.type       = static_cast<file_type>(rec.type);
+		e.code       = rec.code;
+		e.comment    = rec.comment;
+		e.whitespace = rec.whitespace;
+		e.hashed     = rec.hashed != 0;
+		e.hash       = rec.hash;
+	}
+
+	if (m_entries.size() != hdr.entries) {
+		std::cerr << "Cache file " << path << " is truncated, ignoring it" << std::endl;
+		m_entries.clear();
+	}
+
+	return true;
+}
+
+bool result_cache::save()
+{
+	struct cache_header hdr;
+	std::string data;
+
+	if (m_path.empty())
+		return true;
+
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.fingerprint = m_fingerprint;
+	hdr.entries     = m_entries.size();
+
+	data.append(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+
+	for (auto &e : m_entries) {
+		struct cache_record rec;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.stamp      = e.second.stamp;
+		rec.hash       = e.second.hash;
+		rec.type       = static_cast<uint32_t>(e.second.type);
+		rec.code       = e.second.code;
+		rec.comment    = e.second.comment;
+		rec.whitespace = e.second.whitespace;
+		rec.hashed     = e.second.hashed;
+		rec.path_len   = e.first.length();
+
+		data.append(reinterpret_cast<const char *>(&rec), sizeof(rec));
+		data.append(e.first);
+	}
+
+	return write_atomic(m_path, data);
+}
+
+// Paths below the scan root are made absolute, everything else is taken as is
+std::string result_cache::key(const std::string &path) const
+{
+	if (m_scan_root.empty() || path.compare(0, m_scan_root.length(), m_scan_root) != 0)
+		return path;
+
+	return m_key_root + path.substr(m_scan_root.length());
+}
+
+const struct cache_entry *result_cache::lookup(const std::string &path,
+					       const struct file_stamp &stamp,
+					       file_type type) const
+{
+	std::string k = key(path);
+	auto e = m_old.find(k);
+
+	if (e == m_old.end()) {
+		e = m_entries.find(k);
+		if (e == m_entries.end())
+			return nullptr;
+	}
+
+	if (!(e->second.stamp == stamp) || e->second.type != type)
+		return nullptr;
+
+	return &e->second;
+}
+
+void result_cache::update(const std::string &path, const struct cache_entry &entry)
+{
+	if (entry.stamp.mtime_ns + RACY_NS > m_start_ns ||
+	    !counts_fit(entry.code, entry.comment, entry.whitespace))
+		return;
+
+	m_entries[key(path)] = entry;
+}
+
+/*
+ * Moves all entries below 'root' aside before it is scanned, or only the
+ * entry of 'root' itself when it is a file. They can still be looked up,
+ * but only the files the scan updates stay in the cache, entries of files
+ * which are gone must not stay around forever.
+ */
+void result_cache::begin_scan(const std::string &root, bool dir)
+{
+	char *real = realpath(root.c_str(), nullptr);
+
+	m_scan_root = root;
+	m_key_root  = real != nullptr ? real : root;
+	free(real);
+
+	if (dir) {
+		if (*m_scan_root.rbegin() != '/')
+			m_scan_root += '/';
+		if (*m_key_root.rbegin() != '/')
+			m_key_root += '/';
+	}
+
+	m_old.clear();
+
+	for (auto e = m_entries.begin(); e != m_entries.end();) {
+		auto cur = e++;
+
+		if (dir ? cur->first.compare(0, m_key_root.length(), m_key_root) == 0
+			: cur->first == m_key_root)
+			m_old.insert(m_entries.extract(cur));
+	}
+}
+
+// An incomplete scan keeps the entries it did not get to
+void result_cache::end_scan(bool complete)
+{
+	if (!complete)
+		m_entries.merge(m_old);
+
+	m_old.clear();
+}
+
+static bool blob_less(const struct blob_record &a, const struct blob_record &b)
+{
+	int ret = memcmp(a.oid, b.oid, BLOB_OID_SIZE);
+
+	return ret < 0 || (ret == 0 && a.type < b.type);
+}
+
+static bool blob_equal(const struct blob_record &a, const struct blob_record &b)
+{
+	return memcmp(a.oid, b.oid, BLOB_OID_SIZE) == 0 && a.type == b.type;
+}
+
+blob_cache::blob_cache()
+	: m_fingerprint { 0, 0 }, m_records(nullptr), m_nr(0),
+	  m_map(nullptr), m_map_size(0)
+{
+}
+
+blob_cache::~blob_cache()
+{
+	if (m_map != nullptr)
+		munmap(m_map, m_map_size);
+}
+
+bool blob_cache::load(const char *path)
+{
+	const struct cache_header *hdr;
+	struct stat st;
+	void *map;
+	int fd;
+
+	m_path = path;
+
+	// The hash function plays no role for blobs
+	m_fingerprint = rules_fingerprint(hash_algo::murmur3);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return true;
+
+	if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(*hdr)) {
+		close(fd);
+		return true;
+	}
+
+	map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return true;
+
+	m_map      = map;
+	m_map_size = st.st_size;
+
+	hdr = static_cast<const struct cache_header *>(map);
+
+	if (memcmp(hdr->magic, BLOB_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    !(hdr->fingerprint == m_fingerprint))
+		return true;
+
+	if (hdr->entries != (m_map_size - sizeof(*hdr)) / sizeof(struct blob_record)) {
+		std::cerr << "Cache file " << path << " is truncated, ignoring it" << std::endl;
+		return true;
+	}
+
+	m_records = reinterpret_cast<const struct blob_record *>(hdr + 1);
+	m_nr      = hdr->entries;
+
+	return true;
+}
+
+const struct blob_record *blob_cache::lookup(const unsigned char *oid, file_type type) const
+{
+	struct blob_record key;
+
+	memcpy(key.oid, oid, BLOB_OID_SIZE);
+	key.type = static_cast<uint32_t>(type);
+
+	auto r = std::lower_bound(m_records, m_records + m_nr, key, blob_less);
+
+	if (r == m_records + m_nr || !blob_equal(*r, key))
+		return nullptr;
+
+	return r;
+}
+
+void blob_cache::add(const unsigned char *oid, file_type type,
+		     uint64_t code, uint64_t comment, uint64_t whitespace)
+{
+	struct blob_record r;
+
+	if (!counts_fit(code, comment, whitespace))
+		return;
+
+	memcpy(r.oid, oid, BLOB_OID_SIZE);
+	r.type       = static_cast<uint32_t>(type);
+	r.code       = code;
+	r.comment    = comment;
+	r.whitespace = whitespace;
+
+	m_new.push_back(r);
+}
+
+bool blob_cache::save()
+{
+	const struct blob_record *old = m_records, *old_end = m_records + m_nr;
+	struct cache_header hdr;
+	std::string data;
+	size_t nr = 0;
+
+	if (m_path.empty() || m_new.empty())
+		return true;
+
+	std::sort(m_new.begin(), m_new.end(), blob_less);
+
+	data.reserve(sizeof(hdr) + (m_nr + m_new.size()) * sizeof(struct blob_record));
+	data.resize(sizeof(hdr));
+
+	auto append = [&](const struct blob_record &r) {
+		data.append(reinterpret_cast<const char *>(&r), sizeof(r));
+		nr += 1;
+	};
+
+	// Merge both sorted lists, dropping duplicates
+	for (auto n = m_new.begin(); n != m_new.end(); ++n) {
+		if (n + 1 != m_new.end() && blob_equal(*n, *(n + 1)))
+			continue;
+
+		while (old != old_end && blob_less(*old, *n))
+			append(*old++);
+
+		if (old != old_end && blob_equal(*old, *n))
+			continue;
+
+		append(*n);
+	}
+
+	while (old != old_end)
+		append(*old++);
+
+	memcpy(hdr.magic, BLOB_MAGIC, sizeof(hdr.magic));
+	hdr.fingerprint = m_fingerprint;
+	hdr.entries     = nr;
+
+	memcpy(&data[0], &hdr, sizeof(hdr));
+
+	return write_atomic(m_path, data);
+}
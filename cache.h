@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include <unordered_map>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "classifier.h"
+#include "hash.h"
+
+// Identifies a version of a file without reading it
+struct file_stamp {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime_ns;
+
+	bool operator==(const file_stamp &o) const
+	{
+		return dev == o.dev && ino == o.ino && size == o.size && mtime_ns == o.mtime_ns;
+	}
+};
+
+struct cache_entry {
+	struct file_stamp stamp;
+	file_type type;
+	uint64_t code;
+	uint64_t comment;
+	uint64_t whitespace;
+	bool hashed;
+	content_hash hash;
+};
+
+/*
+ * Counts of files from earlier runs, keyed by absolute path, so that scans
+ * of the same tree from different directories share their entries. The
+ * cache file records a fingerprint of the counting rules, the file types
+ * and the hash function. When any of them changed the old results are
+ * dropped.
+ */
+class result_cache {
+protected:
+	std::unordered_map<std::string, struct cache_entry> m_entries;
+	std::unordered_map<std::string, struct cache_entry> m_old;
+	std::string m_path;
+	content_hash m_fingerprint;
+	uint64_t m_start_ns;
+	std::string m_scan_root;	// As given on the command line
+	std::string m_key_root;		// The same, resolved with realpath()
+
+	std::string key(const std::string &path) const;
+
+public:
+	result_cache();
+	bool load(const char *path, hash_algo algo);
+	bool save();
+
+	const struct cache_entry *lookup(const std::string &path,
+					 const struct file_stamp &stamp,
+					 file_type type) const;
+	void update(const std::string &path, const struct cache_entry &entry);
+	void begin_scan(const std::string &root, bool dir);
+	void end_scan(bool complete);
+};
+
+bool write_atomic(const std::string &path, const std::string &data);
+
+#define BLOB_OID_SIZE	20
+
+struct blob_record {
+	unsigned char oid[BLOB_OID_SIZE];
+	uint32_t type;
+	uint32_t code;
+	uint32_t comment;
+	uint32_t whitespace;
+};
+
+/*
+ * Counts of git blobs, which never change for a given blob and file type.
+ * The cache file is a sorted array of blob_records which is mapped and
+ * searched in place, so loading it costs nothing. New results are kept
+ * aside and merged in when the cache is saved.
+ */
+class blob_cache {
+protected:
+	std::string m_path;
+	content_hash m_fingerprint;
+	const struct blob_record *m_records;
+	size_t m_nr;
+	void *m_map;
+	size_t m_map_size;
+	std::vector<struct blob_record> m_new;
+
+public:
+	blob_cache();
+	~blob_cache();
+	bool load(const char *path);
+	bool save();
+
+	const struct blob_record *lookup(const unsigned char *oid, file_type type) const;
+	void add(const unsigned char *oid, file_type type,
+		 uint64_t code, uint64_t comment, uint64_t whitespace);
+};
+
+#endif
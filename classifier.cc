@@ -7,20 +7,119 @@
  * Author: Jörg Rödel <jroedel@suse.de>
  */
 #include <iostream>
+#include <cstdint>
+#include <mutex>
 #include <map>
 
 #include "classifier.h"
 
-std::map<std::string, unsigned> unknown_exts;
+/*
+ * Open addressing hash tables over the extensions, file names and stems
+ * from filetypes.def. They are built at compile time, so a lookup needs no
+ * allocation and only touches a cache line or two.
+ */
+struct type_entry {
+	std::string_view key;
+	file_type type;
+};
+
+template <size_t N>
+struct type_table {
+	type_entry e[N];
+};
+
+static constexpr uint32_t hash_key(std::string_view key)
+{
+	uint32_t h = 2166136261u;
+
+	for (char c : key)
+		h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+
+	return h;
+}
+
+template <size_t N, size_t M>
+static constexpr type_table<N> build_table(const type_entry (&entries)[M])
+{
+	static_assert((N & (N - 1)) == 0, "Table size must be a power of two");
+	static_assert(M * 2 <= N, "Table too small");
+
+	type_table<N> t{};
+
+	for (const auto &entry : entries) {
+		size_t idx = hash_key(entry.key) & (N - 1);
+
+		while (!t.e[idx].key.empty())
+			idx = (idx + 1) & (N - 1);
+
+		t.e[idx] = entry;
+	}
+
+	return t;
+}
+
+// Returns file_type::unknown if 'key' is not in the table
+template <size_t N>
+static file_type lookup(const type_table<N> &t, std::string_view key)
+{
+	size_t idx = hash_key(key) & (N - 1);
+
+	for (; !t.e[idx].key.empty(); idx = (idx + 1) & (N - 1)) {
+		if (t.e[idx].key == key)
+			return t.e[idx].type;
+	}
+
+	return file_type::unknown;
+}
+
+static constexpr type_entry builtin_exts[] = {
+#define FILE_EXT(ext, id) { ext, file_type::id },
+#include "filetypes.def"
+};
+
+static constexpr type_entry builtin_names[] = {
+#define FILE_NAME(name, id) { name, file_type::id },
+#include "filetypes.def"
+};
+
+static constexpr type_entry builtin_stems[] = {
+#define FILE_STEM(name, id) { name, file_type::id },
+#include "filetypes.def"
+};
+
+static constexpr auto ext_table  = build_table<128>(builtin_exts);
+static constexpr auto name_table = build_table<8>(builtin_names);
+static constexpr auto stem_table = build_table<2>(builtin_stems);
+
+static const char *const type_names[] = {
+#define FILE_TYPE(id, name, counter) name,
+#include "filetypes.def"
+};
+
+static bool record_unknown = false;
+static std::map<std::string, unsigned, std::less<>> unknown_exts;
+static std::mutex unknown_lock;		// Directories are listed in parallel
 
-static void update_unknown_exts(std::string ext)
+// Languages loaded at runtime, these take precedence over the built-in ones
+static std::vector<std::string> user_types;
+static std::map<std::string, file_type, std::less<>> user_exts;
+static std::map<std::string, file_type, std::less<>> user_names;
+
+static void update_unknown_exts(std::string_view ext)
 {
+	std::lock_guard<std::mutex> lock(unknown_lock);
 	auto p = unknown_exts.find(ext);
 
 	if (p == unknown_exts.end())
-		unknown_exts[ext]  = 1;
+		unknown_exts.emplace(ext, 1);
 	else
-		unknown_exts[ext] += 1;
+		p->second += 1;
+}
+
+// Only collected on request, classifile() is on the hot path
+void record_unknown_exts(void)
+{
+	record_unknown = true;
 }
 
 void dump_unknown_exts(void)
@@ -30,134 +129,92 @@ void dump_unknown_exts(void)
 		std::cout << "  [" << e.first << "]: " << e.second << std::endl;
 }
 
-file_type classifile(std::string path)
+file_type add_user_file_type(const std::string &name,
+			     const std::vector<std::string> &exts,
+			     const std::vector<std::string> &names)
+{
+	auto type = static_cast<file_type>(static_cast<unsigned>(file_type::first_user) +
+					   user_types.size());
+
+	user_types.emplace_back(name);
+
+	for (auto &e : exts)
+		user_exts[e] = type;
+
+	for (auto &n : names)
+		user_names[n] = type;
+
+	return type;
+}
+
+bool is_user_file_type(file_type t)
+{
+	return t >= file_type::first_user;
+}
+
+static file_type classify_user(std::string_view name, std::string_view ext)
+{
+	auto u = user_names.find(name);
+	if (u != user_names.end())
+		return u->second;
+
+	if (!ext.empty()) {
+		u = user_exts.find(ext);
+		if (u != user_exts.end())
+			return u->second;
+	}
+
+	return file_type::unknown;
+}
+
+file_type classifile(std::string_view path)
 {
-	std::string name, ext;
+	std::string_view name, ext;
+	file_type type;
 
 	// Extract filename first to eliminate "./path/to/file" cases
-	auto pos = path.find_last_of("/");
-	if (pos != std::string::npos)
-		path = path.substr(pos + 1);
-
-	pos = path.find_last_of(".");
-	if (pos == std::string::npos) {
-		if (path == "Makefile")
-			return file_type::makefile;
-		else if (path == "Kconfig")
-			return file_type::kconfig;
-		else
-			return file_type::unknown;
+	auto pos = path.find_last_of('/');
+	if (pos != std::string_view::npos)
+		path.remove_prefix(pos + 1);
+
+	pos = path.find_last_of('.');
+	if (pos != std::string_view::npos) {
+		name = path.substr(0, pos);
+		ext  = path.substr(pos);
 	}
 
-	name = path.substr(0, pos - 1);
-	ext  = path.substr(pos);
-
-	if (ext == ".o")
-		return file_type::ignore;
-	if (ext == ".c")
-		return file_type::c;
-	if (ext == ".h" || ext == ".hh")
-		return file_type::c_cpp_header;
-	if (ext == ".cc" || ext == ".C" || ext == ".c++")
-		return file_type::cpp;
-	if (ext == ".S")
-		return file_type::assembly;
-	if (ext == ".py")
-		return file_type::python;
-	if (ext == ".pl" || ext == ".pm")
-		return file_type::perl;
-	if (ext == ".xml")
-		return file_type::xml;
-	if (ext == ".html" || ext == ".htm" || ext == ".xhtml")
-		return file_type::html;
-	if (ext == ".svg")
-		return file_type::svg;
-	if (ext == ".xsl" || ext == ".xslt")
-		return file_type::xslt;
-	if (ext == ".java")
-		return file_type::java;
-	if (ext == ".y")
-		return file_type::yacc;
-	if (ext == ".dts" || ext == ".dtsi")
-		return file_type::dts;
-	if (ext == ".sh")
-		return file_type::shell;
-	if (ext == ".yaml")
-		return file_type::yaml;
-	if (ext == ".tex")
-		return file_type::latex;
-	if (ext == ".txt" || ext == ".rst")
-		return file_type::text;
-	if (ext == ".cocci")
-		return file_type::cocci;
-	if (ext == ".asn1")
-		return file_type::asn1;
-	if (ext == ".sed")
-		return file_type::sed;
-	if (ext == ".awk")
-		return file_type::awk;
-	if (ext == ".rs")
-		return file_type::rust;
-	if (ext == ".go")
-		return file_type::go;
-	if (ext == ".json")
-		return file_type::json;
-	if (ext == ".js")
-		return file_type::javascript;
-	if (ext == ".css")
-		return file_type::css;
-	if (ext == ".l")
-		return file_type::lex;
-	if (ext == ".rb")
-		return file_type::ruby;
-	if (ext == ".ts" || ext == ".tsx")
-		return file_type::typescript;
-	if (name == "Kconfig")
-		return file_type::kconfig;
-
-	update_unknown_exts(ext);
+	if (!user_types.empty()) {
+		type = classify_user(path, ext);
+		if (type != file_type::unknown)
+			return type;
+	}
+
+	if (ext.empty())
+		return lookup(name_table, path);
+
+	type = lookup(ext_table, ext);
+	if (type != file_type::unknown)
+		return type;
+
+	type = lookup(stem_table, name);
+	if (type != file_type::unknown)
+		return type;
+
+	if (record_unknown)
+		update_unknown_exts(ext);
 
 	return file_type::unknown;
 }
 
 const char *get_file_type_cstr(file_type t)
 {
-	switch (t) {
-	case file_type::ignore:		return "Ignore";
-	case file_type::directory:	return "Directory";
-	case file_type::unknown:	return "Unknown";
-	case file_type::c:		return "C";
-	case file_type::c_cpp_header:	return "C/C++ Header";
-	case file_type::cpp:		return "C++";
-	case file_type::assembly:	return "Assembler";
-	case file_type::python:		return "Python";
-	case file_type::perl:		return "Perl";
-	case file_type::xml:		return "XML";
-	case file_type::html:		return "HTML";
-	case file_type::svg:		return "SVG";
-	case file_type::xslt:		return "XSLT";
-	case file_type::java:		return "Java";
-	case file_type::yacc:		return "Yacc";
-	case file_type::dts:		return "Device-Tree";
-	case file_type::makefile:	return "Makefile";
-	case file_type::kconfig:	return "Kconfig";
-	case file_type::shell:		return "Shell";
-	case file_type::yaml:		return "YAML";
-	case file_type::latex:		return "LaTeX";
-	case file_type::text:		return "Text";
-	case file_type::cocci:		return "Coccinelle";
-	case file_type::asn1:		return "ASN.1";
-	case file_type::sed:		return "Sed";
-	case file_type::awk:		return "Awk";
-	case file_type::rust:		return "Rust";
-	case file_type::go:		return "Go";
-	case file_type::json:		return "JSON";
-	case file_type::javascript:	return "JavaScript";
-	case file_type::css:		return "CSS";
-	case file_type::lex:		return "Lex";
-	case file_type::ruby:		return "Ruby";
-	case file_type::typescript:	return "TypeScript";
-	}
+	if (!is_user_file_type(t))
+		return type_names[static_cast<size_t>(t)];
+
+	size_t idx = static_cast<size_t>(t) - static_cast<size_t>(file_type::first_user);
+
+	if (idx < user_types.size())
+		return user_types[idx].c_str();
 
 	return nullptr;
 }
@@ -9,47 +9,24 @@
 #ifndef __CLASSIFIER_H
 #define __CLASSIFIER_H
 
+#include <string_view>
 #include <string>
+#include <vector>
 
 enum class file_type {
-	ignore,
-	directory,
-	unknown,
-	c,
-	c_cpp_header,
-	cpp,
-	assembly,
-	python,
-	perl,
-	xml,
-	html,
-	svg,
-	xslt,
-	java,
-	yacc,
-	dts,
-	makefile,
-	kconfig,
-	shell,
-	yaml,
-	latex,
-	text,
-	cocci,
-	asn1,
-	sed,
-	awk,
-	rust,
-	go,
-	json,
-	javascript,
-	css,
-	lex,
-	ruby,
-	typescript,
+#define FILE_TYPE(id, name, counter) id,
+#include "filetypes.def"
+	// Languages loaded at runtime are numbered from here
+	first_user,
 };
 
-file_type classifile(std::string path);
+file_type classifile(std::string_view path);
+void record_unknown_exts(void);
 void dump_unknown_exts(void);
 const char *get_file_type_cstr(file_type t);
+bool is_user_file_type(file_type t);
+file_type add_user_file_type(const std::string &name,
+			     const std::vector<std::string> &exts,
+			     const std::vector<std::string> &names);
 
 #endif
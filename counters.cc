@@ -8,103 +8,78 @@
  */
 #include "classifier.h"
 #include "counters.h"
+#include "scan.h"
 
-struct ml_comment {
-	const char *start;
-	const char *end;
-};
-
-struct src_spec {
-	struct ml_comment ml_comment;
-	const char *sl_comment[];
-};
-
-struct src_spec c_spec {
-	.ml_comment = {
-		.start = "/*",
-		.end   = "*/"
-	},
-	.sl_comment = { "//", nullptr },
+/*
+ * Language descriptions are types, so that every count_* function is a
+ * separate instantiation of count_source() with the comment patterns,
+ * their lengths and lead bytes as compile-time constants. Languages without
+ * comment syntax get a loop which only looks at newlines and strings.
+ */
+struct c_spec {
+	static constexpr const char *ml_start   = "/*";
+	static constexpr const char *ml_end     = "*/";
+	static constexpr const char *sl_comment = "//";
 };
 
-struct src_spec asm_spec {
-	.ml_comment = {
-		.start = "/*",
-		.end   = "*/"
-	},
-	.sl_comment = { "#", nullptr },
+struct asm_spec {
+	static constexpr const char *ml_start   = "/*";
+	static constexpr const char *ml_end     = "*/";
+	static constexpr const char *sl_comment = "#";
 };
 
-struct src_spec python_spec {
-	.ml_comment = {
-		.start = "\"\"\"",
-		.end   = "\"\"\""
-	},
-	.sl_comment = { "#", nullptr },
+struct python_spec {
+	static constexpr const char *ml_start   = "\"\"\"";
+	static constexpr const char *ml_end     = "\"\"\"";
+	static constexpr const char *sl_comment = "#";
 };
 
-struct src_spec shell_spec {
-	.ml_comment = {
-		.start = nullptr,
-		.end   = nullptr
-	},
-	.sl_comment = { "#", nullptr },
+struct shell_spec {
+	static constexpr const char *ml_start   = nullptr;
+	static constexpr const char *ml_end     = nullptr;
+	static constexpr const char *sl_comment = "#";
 };
 
-struct src_spec xml_spec {
-	.ml_comment = {
-		.start = "<!--",
-		.end   = "-->"
-	},
-	.sl_comment = { },
+struct xml_spec {
+	static constexpr const char *ml_start   = "<!--";
+	static constexpr const char *ml_end     = "-->";
+	static constexpr const char *sl_comment = nullptr;
 };
 
-struct src_spec latex_spec {
-	.ml_comment = {
-		.start = nullptr,
-		.end   = nullptr
-	},
-	.sl_comment = { "%", nullptr },
+struct latex_spec {
+	static constexpr const char *ml_start   = nullptr;
+	static constexpr const char *ml_end     = nullptr;
+	static constexpr const char *sl_comment = "%";
 };
 
-struct src_spec text_spec {
-	.ml_comment = {
-		.start = nullptr,
-		.end   = nullptr
-	},
-	.sl_comment = { nullptr },
+struct text_spec {
+	static constexpr const char *ml_start   = nullptr;
+	static constexpr const char *ml_end     = nullptr;
+	static constexpr const char *sl_comment = nullptr;
 };
 
-struct src_spec asn1_spec {
-	.ml_comment = {
-		.start = nullptr,
-		.end   = nullptr
-	},
-	.sl_comment = { "--", nullptr },
+struct asn1_spec {
+	static constexpr const char *ml_start   = nullptr;
+	static constexpr const char *ml_end     = nullptr;
+	static constexpr const char *sl_comment = "--";
 };
 
-struct src_spec rust_spec {
-	.ml_comment = {
-		.start = nullptr,
-		.end   = nullptr
-	},
-	.sl_comment = { "//", nullptr },
+struct rust_spec {
+	static constexpr const char *ml_start   = nullptr;
+	static constexpr const char *ml_end     = nullptr;
+	static constexpr const char *sl_comment = "//";
 };
 
-struct src_spec css_spec {
-	.ml_comment = {
-		.start = "/*",
-		.end   = "*/"
-	},
-	.sl_comment = { nullptr },
+struct css_spec {
+	static constexpr const char *ml_start   = "/*";
+	static constexpr const char *ml_end     = "*/";
+	static constexpr const char *sl_comment = nullptr;
 };
 
-struct src_spec ruby_spec {
-	.ml_comment = {
-		.start = "=begin",
-		.end   = "=end"
-	},
-	.sl_comment = { "#", nullptr },
+struct ruby_spec {
+	static constexpr const char *ml_start   = "=begin";
+	static constexpr const char *ml_end     = "=end";
+	static constexpr const char *sl_comment = "#";
 };
 
 enum state {
@@ -135,65 +110,28 @@ static bool str_eq(const char *s1, const char *s2, size_t len)
 	return true;
 }
 
-static size_t str_len(const char *s)
+static constexpr size_t str_len(const char *s)
 {
 	size_t len = 0;
 
+	if (s == nullptr)
+		return 0;
+
 	for (len = 0; s[len] != 0; ++len);
 
 	return len;
 }
 
-static bool sl_comment_start(const struct src_spec &spec,
-			     const char *buffer, size_t index, size_t size, size_t &l)
-{
-	size_t i = 0;
-
-	while (spec.sl_comment[i] != nullptr) {
-		const auto pattern = spec.sl_comment[i++];
-		auto len = str_len(pattern);
-		auto buf_len = size - index;
-
-		if (len > buf_len)
-			continue;
-
-		if (str_eq(pattern, &buffer[index], len)) {
-			l = len;
-			return true;
-		}
-	}
-
-	return false;
-}
-
-static bool ml_comment_start(const struct src_spec &spec,
-			     const char *buffer, size_t index, size_t size, size_t &l)
+static inline bool pattern_at(const char *pattern, size_t len,
+			      const char *buffer, size_t index, size_t size)
 {
-	const auto str = spec.ml_comment.start;
-
-	if (str == nullptr)
-		return false;
-
-	auto len = str_len(str);
-	auto buf_len = size - index;
-	l = len;
-
-	return ((len <= buf_len) && str_eq(str, &buffer[index], len));
+	return ((len <= size - index) && str_eq(pattern, &buffer[index], len));
 }
 
-static bool ml_comment_end(const struct src_spec &spec,
-			   const char *buffer, size_t index, size_t size, size_t &l)
+// Same as isspace() in the C locale, without the function call
+static inline bool is_space(char c)
 {
-	const auto str = spec.ml_comment.end;
-
-	if (str == nullptr)
-		return false;
-
-	auto len = str_len(str);
-	auto buf_len = size - index;
-	l = len;
-
-	return ((len <= buf_len) && str_eq(str, &buffer[index], len));
+	return c == ' ' || (c >= '\t' && c <= '\r');
 }
 
 static void finish_line(struct file_result &r, bool &code, bool &comment, size_t &counter)
@@ -211,39 +149,80 @@ static void finish_line(struct file_result &r, bool &code, bool &comment, size_t
 	counter = 0;
 }
 
-static void generic_count_source(const struct src_spec &spec,
-				 struct file_result &r,
-				 const char *buffer,
-				 size_t size)
+template <typename Spec>
+static void count_source(struct file_result &r, const char *buffer, size_t size)
 {
+	constexpr size_t ml_start_len = str_len(Spec::ml_start);
+	constexpr size_t ml_end_len   = str_len(Spec::ml_end);
+	constexpr size_t sl_len       = str_len(Spec::sl_comment);
+	constexpr char ml_start_lead  = ml_start_len ? Spec::ml_start[0] : '\n';
+	constexpr char ml_end_lead    = ml_end_len ? Spec::ml_end[0] : '\n';
+	constexpr char sl_lead        = sl_len ? Spec::sl_comment[0] : '\n';
+
+	/*
+	 * Bytes which can change the counter state. Everything else is skipped
+	 * with scan_bytes(). In BEGIN state this is only possible once the line
+	 * is known to contain code, before that every non-space byte matters.
+	 */
+	static constexpr struct scan_set begin_set     = {{ '\n', '"', ml_start_lead, sl_lead }};
+	static constexpr struct scan_set string_set    = {{ '\n', '"', '\n', '"' }};
+	static constexpr struct scan_set newline_set   = {{ '\n', '\n', '\n', '\n' }};
+	static constexpr struct scan_set mlcomment_set = {{ '\n', ml_end_lead, '\n', ml_end_lead }};
+
 	bool code = false, comment = false;
 	enum state state = BEGIN;
-	size_t counter = 0, len;
+	size_t counter = 0;
 	char c = 0, lc;
 
 	if (size == 0)
 		return;
 
 	for (size_t index = 0; index < size; ++index, ++counter) {
+		const struct scan_set *set = nullptr;
+
+		if (state == BEGIN && code)
+			set = &begin_set;
+		else if (state == STRING)
+			set = &string_set;
+		else if (state == SLCOMMENT)
+			set = &newline_set;
+		else if (state == MLCOMMENT)
+			set = &mlcomment_set;
+
+		if (set != nullptr) {
+			size_t next = scan_bytes(buffer, index, size, *set);
+
+			if (next != index) {
+				// Same state as if the skipped bytes were processed
+				counter += next - index;
+				c = buffer[next - 1];
+				index = next;
+				if (index == size)
+					break;
+			}
+		}
+
 		lc = c;
 		c  = buffer[index];
 
 		if (state == BEGIN) {
-			if (ml_comment_start(spec, buffer, index, size, len)) {
+			if (ml_start_len && c == ml_start_lead &&
+			    pattern_at(Spec::ml_start, ml_start_len, buffer, index, size)) {
 				comment = true;
 				state   = MLCOMMENT;
-				index += len - 1;
-			} else if (sl_comment_start(spec, buffer, index, size, len)) {
+				index += ml_start_len - 1;
+			} else if (sl_len && c == sl_lead &&
+				   pattern_at(Spec::sl_comment, sl_len, buffer, index, size)) {
 				comment = true;
 				state   = SLCOMMENT;
-				index += len - 1;
+				index += sl_len - 1;
 			} else if (c == '"') {
 				code = true;
 				state = STRING;
 			} else if (c == '\n') {
 				finish_line(r, code, comment, counter);
 				code = comment = false;
-			} else if (!isspace(c) && c != '/') {
+			} else if (!is_space(c) && c != '/') {
 				code = true;
 			}
 		} else if (state == STRING) {
@@ -261,9 +240,10 @@ static void generic_count_source(const struct src_spec &spec,
 				state = BEGIN;
 			}
 		} else if (state == MLCOMMENT) {
-			if (ml_comment_end(spec, buffer, index, size, len)) {
+			if (ml_end_len && c == ml_end_lead &&
+			    pattern_at(Spec::ml_end, ml_end_len, buffer, index, size)) {
 				state = BEGIN;
-				index += len - 1;
+				index += ml_end_len - 1;
 			} else if (c == '\n') {
 				finish_line(r, code, comment, counter);
 				code    = false;
@@ -276,6 +256,7 @@ static void generic_count_source(const struct src_spec &spec,
 	if (c != '\n')
 		finish_line(r, code, comment, counter);
 }
+
 static size_t perl_strip__END__(const char *buffer, size_t size)
 {
 	const char *pattern = "__END__";
@@ -286,13 +267,13 @@ static size_t perl_strip__END__(const char *buffer, size_t size)
 		if (buffer[ret] != '\n')
 			continue;
 
-		auto remain = size - ret;
+		auto remain = size - ret - 1;
 
 		if (remain < pattern_len)
 			break;
 
 		if (str_eq(&buffer[ret + 1], pattern, pattern_len))
-			return ret - 1;
+			return ret > 0 ? ret - 1 : 0;
 	}
 
 	return size;
@@ -300,62 +281,62 @@ static size_t perl_strip__END__(const char *buffer, size_t size)
 
 void count_c(struct file_result &r, const char *buffer, size_t size)
 {
-	generic_count_source(c_spec, r, buffer, size);
+	count_source<c_spec>(r, buffer, size);
 }
 
 void count_asm(struct file_result &r, const char *buffer, size_t size)
 {
-	generic_count_source(asm_spec, r, buffer, size);
+	count_source<asm_spec>(r, buffer, size);
 }
 
 void count_python(struct file_result &r, const char *buffer, size_t size)
 {
-	generic_count_source(python_spec, r, buffer, size);
+	count_source<python_spec>(r, buffer, size);
 }
 
 void count_perl(struct file_result &r, const char *buffer, size_t size)
 {
 	// Perl needs some pre-processing
 	size = perl_strip__END__(buffer, size);
-	generic_count_source(shell_spec, r, buffer, size);
+	count_source<shell_spec>(r, buffer, size);
 }
 
 void count_xml(struct file_result &r, const char *buffer, size_t size)
 {
-	generic_count_source(xml_spec, r, buffer, size);
+	count_source<xml_spec>(r, buffer, size);
 }
 
 void count_shell(struct file_result &r, const char *buffer, size_t size)
 {
-	generic_count_source(shell_spec, r, buffer, size);
+	count_source<shell_spec>(r, buffer, size);
 }
 
 void count_latex(struct file_result &r, const char *buffer, size_t size)
 {
-	generic_count_source(latex_spec, r, buffer, size);
+	count_source<latex_spec>(r, buffer, size);
 }
 
 void count_text(struct file_result &r, const char *buffer, size_t size)
 {
-	generic_count_source(text_spec, r, buffer, size);
+	count_source<text_spec>(r, buffer, size);
 }
 
 void count_asn1(struct file_result &r, const char *buffer, size_t size)
 {
-	generic_count_source(asn1_spec, r, buffer, size);
+	count_source<asn1_spec>(r, buffer, size);
 }
 
 void count_rust(struct file_result &r, const char *buffer, size_t size)
 {
-	generic_count_source(rust_spec, r, buffer, size);
+	count_source<rust_spec>(r, buffer, size);
 }
 
 void count_css(struct file_result &r, const char *buffer, size_t size)
 {
-	generic_count_source(css_spec, r, buffer, size);
+	count_source<css_spec>(r, buffer, size);
 }
 
 void count_ruby(struct file_result &r, const char *buffer, size_t size)
 {
-	generic_count_source(ruby_spec, r, buffer, size);
+	count_source<ruby_spec>(r, buffer, size);
 }
@@ -13,10 +13,16 @@
 
 #include "classifier.h"
 
+/*
+ * Bump whenever the counting rules change, results cached by earlier
+ * versions are thrown away then.
+ */
+#define COUNTER_VERSION		1
+
 struct file_result {
-	uint32_t code;
-	uint32_t comment;
-	uint32_t whitespace;
+	uint64_t code;
+	uint64_t comment;
+	uint64_t whitespace;
 	bool duplicate;
 	file_type type;
 	std::string name;
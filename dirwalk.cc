@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+#include "dirwalk.h"
+#include "stats.h"
+
+struct linux_dirent64 {
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+dir_reader::dir_reader()
+	: m_fd(-1), m_buffer(new char[DIR_READ_BUFFER_SIZE]), m_pos(0), m_len(0)
+{
+}
+
+dir_reader::~dir_reader()
+{
+	if (m_fd >= 0) {
+		stats_syscall(stats_call::close);
+		close(m_fd);
+	}
+}
+
+bool dir_reader::open(const char *path)
+{
+	stats_syscall(stats_call::open);
+	m_fd = ::open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	return m_fd >= 0;
+}
+
+bool dir_reader::open(int fd)
+{
+	m_fd = fd;
+
+	return m_fd >= 0;
+}
+
+int dir_reader::next(struct dir_entry_ref &e)
+{
+	while (true) {
+		struct linux_dirent64 *d;
+		unsigned char type;
+
+		if (m_pos == m_len) {
+			stats_syscall(stats_call::getdents);
+			m_len = syscall(SYS_getdents64, m_fd, m_buffer.get(), DIR_READ_BUFFER_SIZE);
+			m_pos = 0;
+
+			if (m_len < 0) {
+				m_len = 0;
+				return -1;
+			}
+			if (m_len == 0)
+				return 0;
+		}
+
+		d      = reinterpret_cast<struct linux_dirent64 *>(m_buffer.get() + m_pos);
+		m_pos += d->d_reclen;
+		type   = d->d_type;
+
+		// Also takes care of "." and ".."
+		if (d->d_name[0] == '.')
+			continue;
+
+		e.name = d->d_name;
+		e.dir  = false;
+		e.st   = nullptr;
+
+		if (type == DT_UNKNOWN) {
+			stats_syscall(stats_call::stat);
+			if (fstatat(m_fd, d->d_name, &m_st, AT_SYMLINK_NOFOLLOW) < 0)
+				continue;
+
+			if (S_ISDIR(m_st.st_mode))
+				type = DT_DIR;
+			else if (S_ISLNK(m_st.st_mode))
+				type = DT_LNK;
+			else if (S_ISREG(m_st.st_mode))
+				e.st = &m_st;
+			else
+				continue;
+		}
+
+		// Dangling links are skipped silently
+		if (type == DT_LNK) {
+			stats_syscall(stats_call::stat);
+			if (fstatat(m_fd, d->d_name, &m_st, 0) < 0 || !S_ISREG(m_st.st_mode))
+				continue;
+			e.st = &m_st;
+		} else if (type == DT_DIR) {
+			e.dir = true;
+		} else if (type != DT_REG && e.st == nullptr) {
+			continue;
+		}
+
+		return 1;
+	}
+}
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#ifndef __DIRWALK_H
+#define __DIRWALK_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#include <sys/stat.h>
+
+#define DIR_READ_BUFFER_SIZE	(32 * 1024)
+
+// An entry returned by dir_reader, only valid until the next call
+struct dir_entry_ref {
+	const char *name;
+	bool dir;			// Otherwise a regular file
+	const struct stat *st;		// Only set when stat() was needed anyway
+};
+
+/*
+ * Reads one directory with getdents64(). Entries are told apart by their
+ * d_type, stat() is only called on file systems which don't fill it in,
+ * and on symbolic links. Links to files are followed, links to
+ * directories are not. Hidden entries and everything which is neither a
+ * regular file nor a directory are skipped.
+ */
+class dir_reader {
+protected:
+	int m_fd;
+	std::unique_ptr<char[]> m_buffer;
+	long m_pos;
+	long m_len;
+	struct stat m_st;
+
+public:
+	dir_reader();
+	~dir_reader();
+
+	bool open(const char *path);
+	bool open(int fd);		// Takes over an opened directory
+
+	// Returns 1 for an entry, 0 at the end and -1 with errno set on errors
+	int next(struct dir_entry_ref &e);
+
+	// To access entries relative to the directory
+	int fd() const		{ return m_fd; }
+};
+
+#endif
@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#include <cstring>
+
+#include "filelist.h"
+
+#define ARENA_BLOCK_SIZE	(64 * 1024)
+
+string_arena::string_arena()
+	: m_used(0), m_avail(0)
+{
+}
+
+std::string_view string_arena::store(std::string_view s)
+{
+	char *p;
+
+	if (s.length() > m_avail) {
+		size_t size = std::max<size_t>(s.length(), ARENA_BLOCK_SIZE);
+
+		m_blocks.emplace_back(new char[size]);
+		m_used  = 0;
+		m_avail = size;
+	}
+
+	p = m_blocks.back().get() + m_used;
+	memcpy(p, s.data(), s.length());
+
+	m_used  += s.length();
+	m_avail -= s.length();
+
+	return std::string_view(p, s.length());
+}
+
+file_list::file_list()
+{
+	m_dirs.push_back(dir_entry { root_dir, std::string_view(), std::string_view() });
+}
+
+/*
+ * Splits 'path' at the last slash. A leading slash stays part of the
+ * directory, so that absolute paths keep their root.
+ */
+static void split_path(std::string_view path, std::string_view &dir, std::string_view &name)
+{
+	auto pos = path.find_last_of('/');
+
+	if (pos == std::string_view::npos) {
+		dir  = std::string_view();
+		name = path;
+		return;
+	}
+
+	name = path.substr(pos + 1);
+	dir  = path.substr(0, pos);
+
+	while (dir.length() > 1 && dir.back() == '/')
+		dir.remove_suffix(1);
+
+	if (dir.empty())
+		dir = path.substr(0, 1);
+}
+
+uint32_t file_list::intern_dir(std::string_view path)
+{
+	std::string_view parent, name;
+	uint32_t parent_id, id;
+
+	if (path.empty())
+		return root_dir;
+
+	auto d = m_dir_ids.find(path);
+	if (d != m_dir_ids.end())
+		return d->second;
+
+	if (path == "/") {
+		parent_id = root_dir;
+		name      = path;
+	} else {
+		split_path(path, parent, name);
+		parent_id = intern_dir(parent);
+	}
+
+	path = m_strings.store(path);
+	name = path.substr(path.length() - name.length());
+	id   = m_dirs.size();
+
+	m_dirs.push_back(dir_entry { parent_id, name, path });
+	m_dir_ids.emplace(path, id);
+
+	return id;
+}
+
+void file_list::add(const struct file_result &fr, std::string_view)
+{
+	std::string_view dir, name;
+
+	split_path(fr.name, dir, name);
+
+	m_dir.push_back(intern_dir(dir));
+	m_name.push_back(m_strings.store(name));
+	m_type.push_back(fr.type);
+	m_duplicate.push_back(fr.duplicate);
+	m_code.push_back(fr.code);
+	m_comment.push_back(fr.comment);
+	m_whitespace.push_back(fr.whitespace);
+}
+
+std::string file_list::path(size_t i) const
+{
+	auto d = m_dirs[m_dir[i]].path;
+	std::string p;
+
+	p.reserve(d.length() + m_name[i].length() + 1);
+	p = d;
+
+	if (!p.empty() && p.back() != '/')
+		p += '/';
+
+	p += m_name[i];
+
+	return p;
+}
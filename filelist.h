@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#ifndef __FILELIST_H
+#define __FILELIST_H
+
+#include <unordered_map>
+#include <string_view>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "classifier.h"
+#include "counters.h"
+
+/*
+ * Append-only array made of fixed size chunks. Growing it never moves
+ * existing elements, so there are no large copies and references stay
+ * valid.
+ */
+template <typename T, size_t CHUNK = 4096>
+class chunked_array {
+protected:
+	std::vector<std::unique_ptr<T[]>> m_chunks;
+	size_t m_size = 0;
+
+public:
+	void push_back(const T &v)
+	{
+		if (m_size % CHUNK == 0)
+			m_chunks.emplace_back(new T[CHUNK]);
+
+		m_chunks.back()[m_size % CHUNK] = v;
+		m_size += 1;
+	}
+
+	T &operator[](size_t idx)
+	{
+		return m_chunks[idx / CHUNK][idx % CHUNK];
+	}
+
+	const T &operator[](size_t idx) const
+	{
+		return m_chunks[idx / CHUNK][idx % CHUNK];
+	}
+
+	size_t size() const
+	{
+		return m_size;
+	}
+};
+
+// Storage for strings which live as long as the arena
+class string_arena {
+protected:
+	std::vector<std::unique_ptr<char[]>> m_blocks;
+	size_t m_used;
+	size_t m_avail;
+
+public:
+	string_arena();
+	std::string_view store(std::string_view s);
+};
+
+/*
+ * Receives the results of a scan, one file at a time. 'hash' identifies
+ * the content in hex, it is empty when the file was not hashed. flush()
+ * is called while the scan waits for more results, so that sinks which
+ * stream their output can pass on what they have.
+ */
+class result_sink {
+public:
+	virtual ~result_sink() { }
+	virtual void add(const struct file_result &fr, std::string_view hash) = 0;
+	virtual void flush() { }
+};
+
+// Hands every result to two sinks
+class result_tee : public result_sink {
+protected:
+	result_sink &m_first;
+	result_sink &m_second;
+
+public:
+	result_tee(result_sink &first, result_sink &second)
+		: m_first(first), m_second(second)
+	{
+	}
+
+	void add(const struct file_result &fr, std::string_view hash) override
+	{
+		m_first.add(fr, hash);
+		m_second.add(fr, hash);
+	}
+
+	void flush() override
+	{
+		m_first.flush();
+		m_second.flush();
+	}
+};
+
+/*
+ * Results of all files of a scan. Directories are interned, every file
+ * only stores the id of its directory and its base name. The counters are
+ * kept in separate arrays, so passes which only look at the counts touch
+ * as little memory as possible.
+ */
+class file_list : public result_sink {
+public:
+	struct dir_entry {
+		uint32_t parent;
+		std::string_view name;	// Last path component
+		std::string_view path;	// Full path
+	};
+
+	// Directory id of the (empty) root
+	static const uint32_t root_dir = 0;
+
+protected:
+	string_arena m_strings;
+	std::vector<struct dir_entry> m_dirs;
+	std::unordered_map<std::string_view, uint32_t> m_dir_ids;
+
+	chunked_array<uint32_t> m_dir;
+	chunked_array<std::string_view> m_name;
+	chunked_array<file_type> m_type;
+	chunked_array<bool> m_duplicate;
+	chunked_array<uint64_t> m_code;
+	chunked_array<uint64_t> m_comment;
+	chunked_array<uint64_t> m_whitespace;
+
+	uint32_t intern_dir(std::string_view path);
+
+public:
+	file_list();
+
+	void add(const struct file_result &fr, std::string_view hash) override;
+
+	size_t size() const			{ return m_type.size(); }
+	uint32_t dir(size_t i) const		{ return m_dir[i]; }
+	std::string_view name(size_t i) const	{ return m_name[i]; }
+	file_type type(size_t i) const		{ return m_type[i]; }
+	bool duplicate(size_t i) const		{ return m_duplicate[i]; }
+	uint64_t code(size_t i) const		{ return m_code[i]; }
+	uint64_t comment(size_t i) const	{ return m_comment[i]; }
+	uint64_t whitespace(size_t i) const	{ return m_whitespace[i]; }
+	std::string path(size_t i) const;
+
+	size_t dirs() const			{ return m_dirs.size(); }
+	const struct dir_entry &get_dir(uint32_t d) const { return m_dirs[d]; }
+};
+
+#endif
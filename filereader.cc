@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#include <iostream>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "filereader.h"
+#include "stats.h"
+
+/*
+ * Setting up and tearing down a mapping costs about as much as copying
+ * 200-250KiB of file data with read(). Below that size a copy into the
+ * re-used buffer is faster, above it the mapping wins by a growing margin.
+ */
+#define MMAP_THRESHOLD	(256 * 1024)
+
+void file_buffer::resize_buffer(size_t new_size)
+{
+	if (buffer != nullptr && new_size <= size)
+		return;
+
+	// Empty files need a buffer too, nullptr means the read failed
+	delete [] buffer;
+	buffer = new char[new_size + 1];
+	size   = new_size;
+}
+
+file_buffer::~file_buffer()
+{
+	if (buffer != nullptr)
+		delete [] buffer;
+}
+
+static bool read_fd_to_buffer(int fd, const char *path, char *buffer, size_t size)
+{
+	size_t fill = 0;
+
+	while (size) {
+		stats_syscall(stats_call::read);
+		auto r = ::read(fd, buffer + fill, size);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			std::cerr << "Error reading file " << path << std::endl;
+			break;
+		} else if (r == 0) {
+			std::cerr << "Unexpected end of file " << path << std::endl;
+			break;
+		} else {
+			fill += r;
+			size -= r;
+		}
+	}
+
+	return size == 0;
+}
+
+file_reader::file_reader(io_mode mode)
+	: m_mode(mode), m_map(nullptr), m_map_size(0)
+{
+}
+
+file_reader::~file_reader()
+{
+	release();
+}
+
+void file_reader::release()
+{
+	if (m_map == nullptr)
+		return;
+
+	stats_syscall(stats_call::munmap);
+	munmap(m_map, m_map_size);
+	m_map      = nullptr;
+	m_map_size = 0;
+}
+
+const char *file_reader::read_copy(int fd, const char *path, size_t size)
+{
+	m_fb.resize_buffer(size);
+
+	if (!read_fd_to_buffer(fd, path, m_fb.buffer, size))
+		return nullptr;
+
+	return m_fb.buffer;
+}
+
+const char *file_reader::read_map(int fd, const char *path, size_t size)
+{
+	struct stat st;
+	void *map;
+
+	/*
+	 * The size comes from the directory scan. Mapping a file which was
+	 * truncated since then raises SIGBUS on access, read() fails cleanly.
+	 */
+	stats_syscall(stats_call::stat);
+	if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) != size)
+		return read_copy(fd, path, size);
+
+	stats_syscall(stats_call::mmap);
+	map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	if (map == MAP_FAILED)
+		return read_copy(fd, path, size);
+
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	m_map      = map;
+	m_map_size = size;
+
+	return static_cast<const char *>(map);
+}
+
+const char *file_reader::read(const char *path, size_t size)
+{
+	const char *data;
+	int fd;
+
+	release();
+
+	stats_syscall(stats_call::open);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		std::cerr << "Can't open " << path << " for reading" << std::endl;
+		return nullptr;
+	}
+
+	if (m_mode != io_mode::mmap || size < MMAP_THRESHOLD)
+		data = read_copy(fd, path, size);
+	else
+		data = read_map(fd, path, size);
+
+	stats_syscall(stats_call::close);
+	close(fd);
+
+	return data;
+}
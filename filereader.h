@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#ifndef __FILEREADER_H
+#define __FILEREADER_H
+
+#include <cstddef>
+
+enum class io_mode {
+	sync,
+	mmap,
+	uring,
+};
+
+struct file_buffer {
+	size_t size = 0;
+	char *buffer = nullptr;
+
+	void resize_buffer(size_t new_size);
+	~file_buffer();
+};
+
+/*
+ * Reads whole files into memory. In mmap mode large files are mapped instead
+ * of copied, all other files are read into a buffer which is re-used between
+ * calls. The returned data is valid until the next call to read() or
+ * release().
+ */
+class file_reader {
+protected:
+	io_mode m_mode;
+	file_buffer m_fb;
+	void *m_map;
+	size_t m_map_size;
+
+	const char *read_copy(int fd, const char *path, size_t size);
+	const char *read_map(int fd, const char *path, size_t size);
+
+public:
+	file_reader(io_mode mode);
+	~file_reader();
+	const char *read(const char *path, size_t size);
+	void release();
+};
+
+#endif
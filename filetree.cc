@@ -6,15 +6,11 @@
  *
  * Author: Jörg Rödel <jroedel@suse.de>
  */
-#include <experimental/filesystem>
-#include <iostream>
-#include <iomanip>
+#include <algorithm>
 
 #include "classifier.h"
 #include "filetree.h"
 
-namespace fs = std::experimental::filesystem;
-
 loc_result::loc_result()
 	: code(0), comment(0), whitespace(0), files(0)
 {
@@ -30,103 +26,174 @@ loc_result &loc_result::operator+=(const loc_result &r)
 	return *this;
 }
 
-file_entry::file_entry()
-	: m_type(file_type::directory)
+void type_summary::add(const struct file_result &fr, std::string_view)
 {
+	size_t t = static_cast<size_t>(fr.type);
+	loc_result r;
+
+	if (t >= m_results.size()) {
+		m_results.resize(t + 1);
+		m_files.resize(t + 1, 0);
+	}
+
+	m_files[t] += 1;
+
+	if (fr.duplicate)
+		return;
+
+	r.code       = fr.code;
+	r.comment    = fr.comment;
+	r.whitespace = fr.whitespace;
+	r.files      = 1;
+
+	m_results[t] += r;
 }
 
-file_entry *file_entry::get_entry(std::string name, file_type type)
+file_tree::file_tree(const file_list &fl)
+	: m_fl(fl)
 {
-	auto p = m_entries.find(name);
+	size_t dirs = fl.dirs();
+	std::vector<uint32_t> fill;
 
-	if (m_type != file_type::directory)
-		throw std::invalid_argument("get_entry() called on regular file");
+	// Results are printed in file_type order, so are the columns
+	for (size_t f = 0; f < fl.size(); ++f) {
+		size_t t = static_cast<size_t>(fl.type(f));
 
-	if (p == m_entries.end()) {
-		file_entry entry;
+		if (t >= m_columns.size())
+			m_columns.resize(t + 1, -1);
+
+		m_columns[t] = 0;
+	}
 
-		entry.m_type = type;
-		auto i = m_entries.emplace(std::make_pair(name, entry));
-		p = i.first;
+	for (size_t t = 0; t < m_columns.size(); ++t) {
+		if (m_columns[t] < 0)
+			continue;
 
+		m_columns[t] = m_types.size();
+		m_types.push_back(static_cast<file_type>(t));
 	}
 
-	return &p->second;
+	m_results.resize(dirs * m_types.size());
+
+	// Duplicates only count in their own leaf
+	for (size_t f = 0; f < fl.size(); ++f) {
+		loc_result r;
+
+		if (fl.duplicate(f))
+			continue;
+
+		r.code       = fl.code(f);
+		r.comment    = fl.comment(f);
+		r.whitespace = fl.whitespace(f);
+		r.files      = 1;
+
+		result(fl.dir(f), m_columns[static_cast<size_t>(fl.type(f))]) += r;
+	}
+
+	// Post-order roll-up, parents always have smaller ids than their children
+	for (size_t d = dirs - 1; d > 0; --d) {
+		uint32_t parent = fl.get_dir(d).parent;
+
+		for (size_t c = 0; c < m_types.size(); ++c)
+			result(parent, c) += result(d, c);
+	}
+
+	// Build the child lists, sorted by name like the JSON output wants them
+	m_first.assign(dirs + 1, 0);
+
+	for (size_t d = 1; d < dirs; ++d)
+		m_first[fl.get_dir(d).parent + 1] += 1;
+	for (size_t f = 0; f < fl.size(); ++f)
+		m_first[fl.dir(f) + 1] += 1;
+	for (size_t d = 0; d < dirs; ++d)
+		m_first[d + 1] += m_first[d];
+
+	fill.assign(m_first.begin(), m_first.end() - 1);
+	m_children.resize(m_first[dirs]);
+
+	for (size_t d = 1; d < dirs; ++d)
+		m_children[fill[fl.get_dir(d).parent]++] = d;
+	for (size_t f = 0; f < fl.size(); ++f)
+		m_children[fill[fl.dir(f)]++] = f | FILE_TREE_FILE;
+
+	auto name = [&fl](uint64_t c) {
+		return (c & FILE_TREE_FILE) ? fl.name(c & ~FILE_TREE_FILE) : fl.get_dir(c).name;
+	};
+
+	for (size_t d = 0; d < dirs; ++d) {
+		std::sort(m_children.begin() + m_first[d], m_children.begin() + m_first[d + 1],
+			  [&name](uint64_t a, uint64_t b) { return name(a) < name(b); });
+	}
+}
+
+static void jsonize_result(json_writer &w, file_type type, const loc_result &r)
+{
+	w.begin_object();
+	w.member_str("Type", get_file_type_cstr(type));
+	w.member_uint("Files", r.files);
+	w.member_uint("Code", r.code);
+	w.member_uint("Comment", r.comment);
+	w.member_uint("Blank", r.whitespace);
+	w.end_object();
 }
 
-void file_entry::add_results(file_type type, const loc_result& r)
+void file_tree::jsonize_file(json_writer &w, size_t file) const
 {
-	m_results[type] += r;
+	file_type type = m_fl.type(file);
+	loc_result r;
+
+	r.code       = m_fl.code(file);
+	r.comment    = m_fl.comment(file);
+	r.whitespace = m_fl.whitespace(file);
+	r.files      = 1;
+
+	w.begin_object();
+	w.member_str("Type", get_file_type_cstr(type));
+	w.key("Results");
+	w.begin_array();
+	jsonize_result(w, type, r);
+	w.end_array();
+	w.end_object();
 }
 
-void file_entry::jsonize(std::ostream& os, std::string arg)
+// The members of a directory object, without the braces
+void file_tree::jsonize_dir(json_writer &w, uint32_t dir) const
 {
-	bool first = true;
+	const loc_result *results = &m_results[dir * m_types.size()];
 
-	// Open Object
-	os << "{";
+	w.member_str("Type", get_file_type_cstr(file_type::directory));
 
-	// Print Argument, if given
-	if (arg.length() > 0)
-		os << "\"Source\":\"" << arg << "\",";
-
-	// Print type
-	os << "\"Type\":\"" << get_file_type_cstr(m_type) << "\"";
-
-	os << ",\"Results\":[";
-	for (auto &pr : m_results) {
-		if (!first)
-			os << ",";
-		first = false;
-		os << "{";
-		os << "\"Type\":\"" << get_file_type_cstr(pr.first) << "\",";
-		os << "\"Files\":" << pr.second.files << ",";
-		os << "\"Code\":" << pr.second.code << ",";
-		os << "\"Comment\":" << pr.second.comment << ",";
-		os << "\"Blank\":" << pr.second.whitespace;
-		os << "}";
+	w.key("Results");
+	w.begin_array();
+	for (size_t c = 0; c < m_types.size(); ++c) {
+		if (results[c].files != 0)
+			jsonize_result(w, m_types[c], results[c]);
 	}
-	os << "]";
-
-	if (m_type == file_type::directory) {
-		os << ",\"Entries\":{";
-		first = true;
-		for (auto &pe : m_entries) {
-			if (!first)
-				os << ",";
-			first = false;
-			os << "\"" << pe.first << "\":";
-			pe.second.jsonize(os, std::string());
+	w.end_array();
+
+	w.key("Entries");
+	w.begin_object();
+	for (uint32_t i = m_first[dir]; i < m_first[dir + 1]; ++i) {
+		uint64_t c = m_children[i];
+
+		if (c & FILE_TREE_FILE) {
+			w.key(m_fl.name(c & ~FILE_TREE_FILE));
+			jsonize_file(w, c & ~FILE_TREE_FILE);
+		} else {
+			w.key(m_fl.get_dir(c).name);
+			w.begin_object();
+			jsonize_dir(w, c);
+			w.end_object();
 		}
-		os << "}";
 	}
-
-	// Close Object
-	os << "}";
+	w.end_object();
 }
 
-void insert_file_result(file_entry *root, const struct file_result &r)
+void file_tree::jsonize(json_writer &w, const std::string &arg) const
 {
-	fs::path fpath           = r.name;
-	fs::path ppath           = fpath.parent_path();
-	std::string filename     = fpath.filename();
-	struct file_entry *entry = root;
-	loc_result result;
-
-	result.code       = r.code;
-	result.comment    = r.comment;
-	result.whitespace = r.whitespace;
-	result.files      = 1;
-	if (!r.duplicate)
-		root->add_results(r.type, result);
-
-	for (auto &de : ppath) {
-		entry = entry->get_entry(de, file_type::directory);
-		if (!r.duplicate)
-			entry->add_results(r.type, result);
-	}
-
-	entry = entry->get_entry(filename, r.type);
-	entry->add_results(r.type, result);
+	w.begin_object();
+	if (arg.length() > 0)
+		w.member_str("Source", arg);
+	jsonize_dir(w, file_list::root_dir);
+	w.end_object();
 }
-
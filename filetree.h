@@ -9,36 +9,86 @@
 #ifndef __FILETREE_H
 #define __FILETREE_H
 
-#include <ostream>
+#include <cstdint>
 #include <string>
-#include <map>
+#include <vector>
 
 #include "counters.h"
+#include "filelist.h"
+#include "json.h"
 
 struct loc_result {
-	uint32_t code;
-	uint32_t comment;
-	uint32_t whitespace;
-	uint32_t files;
+	uint64_t code;
+	uint64_t comment;
+	uint64_t whitespace;
+	uint64_t files;
 
 	loc_result();
 	loc_result& operator+=(const loc_result&);
 };
 
-class file_entry {
+/*
+ * Per-type totals of a scan. Results are folded in as they are produced,
+ * so its size does not depend on the number of files.
+ */
+class type_summary : public result_sink {
 protected:
-	file_type m_type;
-
-	std::map<file_type, loc_result>   m_results;
-	std::map<std::string, file_entry> m_entries;
+	std::vector<loc_result> m_results;	// Unique files only
+	std::vector<uint64_t> m_files;		// Including duplicates
 
 public:
-	file_entry();
-	file_entry *get_entry(std::string, file_type);
-	void add_results(file_type, const loc_result&);
-	void jsonize(std::ostream&, std::string);
+	void add(const struct file_result &fr, std::string_view hash) override;
+
+	size_t types() const			{ return m_results.size(); }
+	const loc_result &result(size_t t) const	{ return m_results[t]; }
+	uint64_t files(size_t t) const		{ return m_files[t]; }
 };
 
-void insert_file_result(file_entry *root, const struct file_result &r);
+// Children are directory ids or file indexes with this bit set
+#define FILE_TREE_FILE	(1ULL << 63)
+
+/*
+ * Directory tree of a file_list, stored flat. Nodes are the interned
+ * directories of the list, every parent has a smaller id than its
+ * children. The per-type results of all directories live in one array
+ * with a column per file type present in the list. They are summed up
+ * from the leaves to the root in a single pass.
+ */
+class file_tree {
+protected:
+	const file_list &m_fl;
+
+	std::vector<file_type> m_types;		// Column -> file type
+	std::vector<int> m_columns;		// File type -> column
+	std::vector<loc_result> m_results;	// dirs x columns
+
+	// Children of directory d are m_children[m_first[d]..m_first[d + 1])
+	std::vector<uint32_t> m_first;
+	std::vector<uint64_t> m_children;
+
+	loc_result &result(uint32_t dir, int column)
+	{
+		return m_results[dir * m_types.size() + column];
+	}
+
+	void jsonize_dir(json_writer &w, uint32_t dir) const;
+	void jsonize_file(json_writer &w, size_t file) const;
+
+public:
+	file_tree(const file_list &fl);
+	void jsonize(json_writer &w, const std::string &arg) const;
+
+	size_t columns() const			{ return m_types.size(); }
+	file_type column_type(size_t c) const	{ return m_types[c]; }
+
+	const loc_result &dir_result(uint32_t dir, size_t c) const
+	{
+		return m_results[dir * m_types.size() + c];
+	}
+
+	// Children of 'dir', sorted by name
+	const uint64_t *children(uint32_t dir) const	{ return m_children.data() + m_first[dir]; }
+	size_t nr_children(uint32_t dir) const		{ return m_first[dir + 1] - m_first[dir]; }
+};
 
 #endif
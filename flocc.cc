@@ -8,16 +8,22 @@
  */
 #include <experimental/filesystem>
 #include <functional>
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <mutex>
 #include <cerrno>
-#include <list>
 #include <map>
-#include <fstream>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <sys/types.h>
-#include <sys/time.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -25,20 +31,46 @@
 #include <ctype.h>
 #include <git2.h>
 
+#include "cache.h"
 #include "classifier.h"
 #include "counters.h"
+#include "dirwalk.h"
+#include "filereader.h"
+#include "filelist.h"
 #include "filetree.h"
-#include "md4.h"
+#include "hash.h"
+#include "json.h"
+#include "lang.h"
+#include "ndjson.h"
+#include "resultfile.h"
+#include "stats.h"
+#include "uring.h"
+#include "workqueue.h"
 
 #include "version.h"
 
 namespace fs = std::experimental::filesystem;
 
-struct type_result {
-	uint32_t code = 0;
-	uint32_t comment = 0;
-	uint32_t whitespace = 0;
-	uint32_t files = 0;
+// Jobs the file system producer may queue ahead of the oldest unfinished one
+#define FS_MAX_QUEUED	4096
+
+// Directory entries the workers may list ahead of the file system producer
+#define FS_MAX_PREFETCH	(64 * 1024)
+
+// Directories which may be queued for listing at the same time
+#define FS_MAX_LISTING	64
+
+// Upper limit for --jobs, every job is a thread with its own buffers
+#define MAX_JOBS	1024
+
+struct scan_options {
+	unsigned jobs = 1;
+	io_mode io = io_mode::mmap;
+	unsigned io_depth = 32;
+	hash_algo hash = hash_algo::murmur3;
+	result_cache *cache = nullptr;
+	blob_cache *blobs = nullptr;
+	bool hash_all = false;		// Not only files which may be duplicates
 };
 
 struct timing {
@@ -46,38 +78,35 @@ struct timing {
 	uint64_t stop;
 };
 
-struct file_buffer {
-	size_t size = 0;
-	char *buffer = nullptr;
+using file_handler = void (*)(struct file_result &r, const char *buffer, size_t size);
 
-	void resize_buffer(size_t new_size)
-	{
-		if (new_size <= size)
-			return;
-
-		delete [] buffer;
-		buffer = new char[new_size];
-	}
+enum class delta_status {
+	added,
+	removed,
+	modified,
+};
 
-	~file_buffer()
-	{
-		if (buffer != nullptr)
-			delete [] buffer;
-	}
+// Change of one file between two revisions, 'files' is not used here
+struct delta_result {
+	std::string name;
+	file_type type;
+	delta_status status;
+	struct loc_result added;	// Lines only in the new revision
+	struct loc_result removed;	// Lines only in the old revision
 };
 
-using file_handler = std::function<void(struct file_result &r, const char *buffer, size_t size)>;
-using file_list    = std::list<file_result>;
+using delta_list   = std::vector<delta_result>;
 
+// Milliseconds, monotonic so that clock adjustments don't skew the result
 static uint64_t timeval(void)
 {
-	struct timeval tv;
+	struct timespec ts;
 	uint64_t val;
 
-	gettimeofday(&tv, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	val  = tv.tv_sec * 1000;
-	val += tv.tv_usec / 1000;
+	val  = ts.tv_sec * 1000;
+	val += ts.tv_nsec / 1000000;
 
 	return val;
 }
@@ -92,409 +121,2146 @@ static void record_stop(struct timing &t)
 	t.stop = timeval();
 }
 
+static void count_nothing(struct file_result &r, const char *buffer, size_t size)
+{
+}
+
+static void count_user(struct file_result &r, const char *buffer, size_t size)
+{
+	count_lang(r.type, r, buffer, size);
+}
+
+static const file_handler file_handlers[] = {
+#define FILE_TYPE(id, name, counter) counter,
+#include "filetypes.def"
+};
+
+static file_handler get_file_handler(file_type type)
+{
+	file_handler fh;
+
+	if (is_user_file_type(type))
+		return count_user;
+
+	fh = file_handlers[static_cast<size_t>(type)];
+
+	return fh != nullptr ? fh : count_nothing;
+}
+
+/*
+ * Only files of the same size can be duplicates, so a file is hashed only
+ * once another file of its size was found. The producer sets 'want_hash'
+ * of the first file of a size when that happens, which might be too late
+ * when a worker already counted it. Those files are hashed when they are
+ * merged, or when their first twin is merged if they were merged before.
+ * Hard links to an already queued file are not read at all, they take
+ * the results of the file they link to. Neither are files found in the
+ * result cache, unless they need to be hashed.
+ *
+ * Jobs with a 'dir' list that directory instead of counting a file.
+ */
+struct fs_job {
+	struct fs_dir *dir;
+	std::string path;
+	content_hash hash;
+	file_result fr;
+	struct file_stamp stamp;
+	size_t size;
+	std::atomic<bool> want_hash;
+	std::atomic<bool> done;
+	bool link;		// Hard link to a file queued before
+	bool inode_leader;	// First file of a hard linked inode
+	bool size_leader;	// First file of its size
+	bool hashed;
+	bool cached;
+	bool valid;
+
+	fs_job(const std::string &p, std::string name, file_type type,
+	       const struct file_stamp &st, bool l, bool h,
+	       const struct cache_entry *ce)
+		: dir(nullptr), path(p), fr(name), stamp(st), size(st.size), want_hash(h),
+		  done(false), link(l), inode_leader(false), size_leader(false),
+		  hashed(false), cached(false), valid(false)
+	{
+		fr.type = type;
+
+		if (ce != nullptr) {
+			fr.code       = ce->code;
+			fr.comment    = ce->comment;
+			fr.whitespace = ce->whitespace;
+			hash          = ce->hash;
+			hashed        = ce->hashed;
+			cached        = true;
+			valid         = true;
+		}
+	}
+
+	fs_job(struct fs_dir *d)
+		: dir(d), fr(std::string()), stamp(), size(0), want_hash(false),
+		  done(false), link(false), inode_leader(false), size_leader(false),
+		  hashed(false), cached(false), valid(false)
+	{
+	}
+
+	bool needs_read() const
+	{
+		return dir == nullptr && !link && !cached;
+	}
+};
+
+/*
+ * Directories are listed by the workers, sorted by name, and walked depth
+ * first by the producer. Sub-directories are queued for listing ahead of
+ * the producer, by the workers right after listing their parent and by
+ * the producer as it moves on, so wide and deep trees are read in
+ * parallel. Prefetching stops while FS_MAX_LISTING directories are queued
+ * or FS_MAX_PREFETCH listed entries wait for the producer. The order in
+ * which files are queued only depends on their names.
+ */
+struct fs_dirent {
+	std::string name;
+	file_type type;
+	bool linked;				// More than one hard link
+	struct file_stamp stamp;
+	std::unique_ptr<struct fs_dir> dir;	// Only for sub-directories
+};
+
+struct fs_dir {
+	std::string path;			// Ends with a '/'
+	std::vector<struct fs_dirent> entries;
+	size_t prefetched;			// Entries looked at by fs_prefetch()
+	std::atomic<bool> queued;
+	std::atomic<bool> listed;
+	int fd;					// Opened relative to the parent, or -1
+	int error;				// errno of a failed listing
+	std::string error_path;
+
+	fs_dir(std::string p)
+		: path(std::move(p)), prefetched(0), queued(false), listed(false), fd(-1),
+		  error(0)
+	{ }
+
+	~fs_dir()
+	{
+		if (fd >= 0)
+			close(fd);
+	}
+};
+
+struct fs_walk {
+	std::unique_ptr<struct fs_dir> root;
+	std::atomic<size_t> pending;		// Listed entries not walked yet
+	std::atomic<unsigned> listing;		// Queued dirs not listed yet
+
+	fs_walk()
+		: pending(0), listing(0)
+	{ }
+};
+
+// Results of a hard linked file, shared by all links to it
+struct fs_inode {
+	uint64_t code;
+	uint64_t comment;
+	uint64_t whitespace;
+	bool valid;
+};
+
+// First file of a size, 'path' is kept while it still lacks a hash
+struct fs_size {
+	struct fs_job *leader;	// Until the leader is merged
+	std::string path;
+};
+
 /*
- * Use static variants for strlen and strncmp for performance reasons.
- * Performance counting LOC for C/C++ dropped by factor 4 using the
- * variants from the C library.
+ * Duplicate detection state, which lives as long as the scan. Jobs are
+ * merged and freed in enumeration order as soon as they are finished,
+ * so this is all that grows with the number of files.
  */
-static bool read_file_to_buffer(const char *path, char *buffer, size_t size)
+struct fs_dedup {
+	std::unordered_map<uint64_t, struct fs_size> sizes;
+	std::map<std::pair<dev_t, ino_t>, struct fs_inode> inodes;
+	std::unordered_set<content_hash> seen;
+	const struct scan_options *opts;
+	file_reader reader;
+	result_sink &out;
+	size_t max_queued;
+
+	fs_dedup(const struct scan_options &o, result_sink &s)
+		: opts(&o), reader(o.io == io_mode::sync ? io_mode::sync : io_mode::mmap),
+		  out(s), max_queued(FS_MAX_QUEUED + o.jobs * o.io_depth)
+	{ }
+};
+
+static void fs_count_buffer(struct fs_job &job, const char *data, hash_algo algo)
 {
-	size_t fill = 0;
-	int fd;
+	auto handler = get_file_handler(job.fr.type);
+	uint64_t t = stats_now();
 
-	fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		std::cerr << "Can't open " << path << " for reading" << std::endl;
-		return false;
+	stats_read(job.size);
+
+	if (job.want_hash.load(std::memory_order_relaxed)) {
+		job.hash   = hash_content(algo, data, job.size);
+		job.hashed = true;
+
+		stats_hashed(job.size);
+		stats_time(stats_phase::hash, t);
+		t = stats_now();
+	}
+
+	job.valid = true;
+
+	handler(job.fr, data, job.size);
+	stats_time(stats_phase::count, t);
+}
+
+static void fs_count_one(struct fs_job &job, file_reader &reader, hash_algo algo)
+{
+	uint64_t t = stats_now();
+	const char *data;
+
+	data = reader.read(job.path.c_str(), job.size);
+	stats_time(stats_phase::read, t);
+	if (data == nullptr)
+		return;
+
+	fs_count_buffer(job, data, algo);
+
+	reader.release();
+}
+
+static void fs_job_done(work_queue<fs_job> &queue, struct fs_job &job)
+{
+	job.done.store(true, std::memory_order_release);
+	queue.signal();
+}
+
+static struct file_stamp fs_stamp(const struct stat &st)
+{
+	struct file_stamp stamp;
+
+	stamp.dev      = st.st_dev;
+	stamp.ino      = st.st_ino;
+	stamp.size     = st.st_size;
+	stamp.mtime_ns = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+
+	return stamp;
+}
+
+/*
+ * Directories queued while their parent is listed are opened with openat()
+ * right away, the parent is only open during its listing. The others are
+ * opened by their path when they are listed.
+ */
+static void fs_queue_dir(work_queue<fs_job> &queue, struct fs_walk &walk, struct fs_dir &d,
+			 int parent_fd = -1, const char *name = nullptr)
+{
+	if (d.queued.exchange(true))
+		return;
+
+	if (parent_fd >= 0) {
+		stats_syscall(stats_call::open);
+		d.fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+
+	walk.listing.fetch_add(1, std::memory_order_relaxed);
+	queue.push(&d);
+}
+
+// Only called by whoever owns 'd', the worker listing it or the producer
+static bool fs_prefetch(work_queue<fs_job> &queue, struct fs_walk &walk, struct fs_dir &d,
+			int fd = -1)
+{
+	for (; d.prefetched < d.entries.size(); ++d.prefetched) {
+		auto &e = d.entries[d.prefetched];
+
+		if (walk.pending.load(std::memory_order_relaxed) >= FS_MAX_PREFETCH ||
+		    walk.listing.load(std::memory_order_relaxed) >= FS_MAX_LISTING)
+			return false;
+
+		if (e.dir != nullptr)
+			fs_queue_dir(queue, walk, *e.dir, fd, e.name.c_str());
+	}
+
+	return true;
+}
+
+/*
+ * Classification and the stat() of the files are done here, relative to
+ * the directory, so they are spread over the workers as well.
+ */
+static void fs_list_dir(work_queue<fs_job> &queue, struct fs_walk &walk, struct fs_dir &d)
+{
+	uint64_t start = stats_now(), classify_ns = 0;
+	struct dir_entry_ref e;
+	dir_reader reader;
+	bool opened;
+	int ret = -1;
+
+	if (d.fd >= 0)
+		opened = reader.open(d.fd);
+	else
+		opened = reader.open(d.path.c_str());
+	d.fd = -1;
+
+	if (opened) {
+		while ((ret = reader.next(e)) > 0) {
+			struct fs_dirent de;
+			struct stat st;
+
+			de.name = e.name;
+
+			if (e.dir) {
+				de.dir.reset(new fs_dir(d.path + de.name + '/'));
+				d.entries.push_back(std::move(de));
+				continue;
+			}
+
+			uint64_t t = stats_now();
+
+			de.type = classifile(de.name);
+			classify_ns += stats_now() - t;
+
+			if (de.type == file_type::ignore)
+				continue;
+
+			if (e.st != nullptr) {
+				st = *e.st;
+			} else {
+				stats_syscall(stats_call::stat);
+				// Removed since it was listed, like dir_reader does
+				if (fstatat(reader.fd(), e.name, &st, 0) < 0)
+					continue;
+			}
+
+			de.linked = st.st_nlink > 1;
+			de.stamp  = fs_stamp(st);
+
+			d.entries.push_back(std::move(de));
+		}
+	}
+
+	if (ret < 0 && d.error == 0) {
+		d.error      = errno;
+		d.error_path = d.path;
+	}
+
+	std::sort(d.entries.begin(), d.entries.end(), [](const fs_dirent &a, const fs_dirent &b) {
+		return a.name < b.name;
+	});
+
+	stats_add_time(stats_phase::classify, classify_ns);
+	stats_add_time(stats_phase::walk, stats_now() - start - classify_ns);
+
+	walk.pending.fetch_add(d.entries.size(), std::memory_order_relaxed);
+	walk.listing.fetch_sub(1, std::memory_order_relaxed);
+
+	// The producer may free the entries as soon as they are listed
+	fs_prefetch(queue, walk, d, reader.fd());
+	d.listed.store(true, std::memory_order_release);
+}
+
+static void fs_worker(work_queue<fs_job> &queue, struct fs_walk &walk, io_mode mode,
+		      hash_algo algo)
+{
+	file_reader reader(mode);
+	struct fs_job *job;
+
+	while ((job = queue.get()) != nullptr) {
+		if (job->dir != nullptr)
+			fs_list_dir(queue, walk, *job->dir);
+		else if (job->needs_read())
+			fs_count_one(*job, reader, algo);
+
+		fs_job_done(queue, *job);
+	}
+}
+
+/*
+ * Keeps up to io_depth files in flight and counts them as they complete.
+ * Files the ring can not handle, or which failed to read, go through the
+ * synchronous reader, which also takes care of error reporting.
+ */
+static void fs_uring_worker(work_queue<fs_job> &queue, struct fs_walk &walk, unsigned depth,
+			    hash_algo algo)
+{
+	static std::once_flag warn_once;
+	file_reader reader(io_mode::sync);
+	uring_reader uring(depth);
+	struct fs_job *job;
+
+	if (!uring.ok()) {
+		std::call_once(warn_once, [] {
+			std::cerr << "io_uring not available, falling back to mmap" << std::endl;
+		});
+		fs_worker(queue, walk, io_mode::mmap, algo);
+		return;
 	}
 
-	while (size) {
-		auto r = read(fd, buffer + fill, size);
-		if (r < 0 && errno != EINTR) {
-			std::cerr << "Error reading file " << path << std::endl;
+	// Time outside of the callbacks is spent waiting for the reads
+	uint64_t callback_ns = 0;
+
+	auto complete = [&queue, &reader, &callback_ns, algo](void *cookie, const char *data, bool ok) {
+		struct fs_job *job = static_cast<struct fs_job *>(cookie);
+		uint64_t t = stats_now();
+
+		if (ok)
+			fs_count_buffer(*job, data, algo);
+		else
+			fs_count_one(*job, reader, algo);
+
+		fs_job_done(queue, *job);
+		callback_ns += stats_now() - t;
+	};
+
+	while (true) {
+		while (!uring.full() && (job = queue.get(uring.idle())) != nullptr) {
+			if (!job->needs_read()) {
+				if (job->dir != nullptr)
+					fs_list_dir(queue, walk, *job->dir);
+				fs_job_done(queue, *job);
+				continue;
+			}
+			if (!uring.submit(job->path.c_str(), job->size, job)) {
+				fs_count_one(*job, reader, algo);
+				fs_job_done(queue, *job);
+			}
+		}
+
+		if (uring.idle())
 			break;
-		} else if (r == 0) {
-			std::cerr << "Unexpected end of file " << path << std::endl;
+
+		uint64_t t = stats_now();
+
+		callback_ns = 0;
+		uring.complete(complete);
+		stats_add_time(stats_phase::read, stats_now() - t - callback_ns);
+	}
+}
+
+static bool fs_hash_file(struct fs_dedup &dedup, const std::string &path, size_t size,
+			 content_hash &hash)
+{
+	uint64_t t = stats_now();
+	const char *data;
+
+	data = dedup.reader.read(path.c_str(), size);
+	stats_time(stats_phase::read, t);
+	if (data == nullptr)
+		return false;
+
+	t = stats_now();
+	hash = hash_content(dedup.opts->hash, data, size);
+	stats_time(stats_phase::hash, t);
+
+	stats_read(size);
+	stats_hashed(size);
+
+	dedup.reader.release();
+
+	return true;
+}
+
+static void fs_cache_update(result_cache &cache, const struct fs_job &job)
+{
+	struct cache_entry e;
+
+	if (!job.valid || job.link)
+		return;
+
+	e.stamp      = job.stamp;
+	e.type       = job.fr.type;
+	e.code       = job.fr.code;
+	e.comment    = job.fr.comment;
+	e.whitespace = job.fr.whitespace;
+	e.hashed     = job.hashed;
+	e.hash       = job.hash;
+
+	cache.update(job.path, e);
+}
+
+// Runs in enumeration order, which keeps duplicate detection stable
+static void fs_merge_one(struct fs_dedup &dedup, struct fs_job &job)
+{
+	if (job.dir != nullptr)
+		return;
+
+	if (job.link) {
+		auto &ino = dedup.inodes[{ job.stamp.dev, job.stamp.ino }];
+
+		job.valid = ino.valid;
+
+		job.fr.code       = ino.code;
+		job.fr.comment    = ino.comment;
+		job.fr.whitespace = ino.whitespace;
+		job.fr.duplicate  = job.valid;
+	} else {
+		// Got a twin after it was counted
+		if (job.valid && !job.hashed && job.want_hash.load(std::memory_order_relaxed)) {
+			job.valid  = fs_hash_file(dedup, job.path, job.size, job.hash);
+			job.hashed = job.valid;
+		}
+
+		if (job.size_leader) {
+			auto &s = dedup.sizes[job.size];
+
+			s.leader = nullptr;
+			if (job.valid && !job.hashed)
+				s.path = job.path;
+		} else if (job.valid) {
+			auto &s = dedup.sizes[job.size];
+			content_hash hash;
+
+			// Got its first twin after it was merged
+			if (!s.path.empty() && fs_hash_file(dedup, s.path, job.size, hash))
+				dedup.seen.insert(hash);
+
+			s.path = std::string();
+		}
+
+		if (job.valid && job.hashed && !dedup.seen.insert(job.hash).second)
+			job.fr.duplicate = true;
+
+		if (job.inode_leader) {
+			auto &ino = dedup.inodes[{ job.stamp.dev, job.stamp.ino }];
+
+			ino.code       = job.fr.code;
+			ino.comment    = job.fr.comment;
+			ino.whitespace = job.fr.whitespace;
+			ino.valid      = job.valid;
+		}
+	}
+
+	if (dedup.opts->cache != nullptr)
+		fs_cache_update(*dedup.opts->cache, job);
+
+	if (job.valid && job.hashed) {
+		char hex[CONTENT_HASH_HEX_SIZE];
+
+		content_hash_hex(job.hash, hex);
+		dedup.out.add(job.fr, hex);
+	} else {
+		dedup.out.add(job.fr, std::string_view());
+	}
+}
+
+// Waits for 'pred', streaming sinks pass on their results in the meantime
+template <typename Pred>
+static void fs_wait(work_queue<fs_job> &queue, struct fs_dedup &dedup, Pred pred)
+{
+	while (!queue.wait_for(pred, NDJSON_FLUSH_INTERVAL))
+		dedup.out.flush();
+}
+
+/*
+ * Merges the finished jobs at the front of the queue. When too many jobs
+ * are queued the producer waits for the oldest one, so memory use does not
+ * grow with the size of the tree. With 'drain' it waits for all of them.
+ */
+static void fs_merge(work_queue<fs_job> &queue, struct fs_dedup &dedup, bool drain = false)
+{
+	struct fs_job *job;
+
+	while ((job = queue.front()) != nullptr) {
+		auto done = [job] { return job->done.load(std::memory_order_acquire); };
+
+		if (!done()) {
+			if (!drain && queue.size() < dedup.max_queued)
+				break;
+
+			fs_wait(queue, dedup, done);
+		}
+
+		uint64_t t = stats_now();
+
+		fs_merge_one(dedup, *job);
+		stats_time(stats_phase::merge, t);
+		queue.pop();
+	}
+}
+
+/*
+ * The duplicate prefilters run in the enumerating thread, so that their
+ * state needs no locking. Reading, hashing and counting is left to the
+ * workers.
+ */
+static void fs_queue_one(work_queue<fs_job> &queue, struct fs_dedup &dedup,
+			 const std::string &p, size_t rel, const struct fs_dirent &e)
+{
+	const struct cache_entry *ce = nullptr;
+	const struct file_stamp &stamp = e.stamp;
+	std::string name = p.substr(rel);
+	file_type type = e.type;
+	struct fs_job *job;
+
+	if (e.linked) {
+		auto ino = dedup.inodes.find({ stamp.dev, stamp.ino });
+
+		if (ino != dedup.inodes.end()) {
+			queue.push(p, name, type, stamp, true, false, nullptr);
+			fs_merge(queue, dedup);
+			return;
+		}
+	}
+
+	if (dedup.opts->cache != nullptr)
+		ce = dedup.opts->cache->lookup(p, stamp, type);
+
+	auto size = dedup.sizes.find(stamp.size);
+
+	if (size == dedup.sizes.end()) {
+		job = &queue.push(p, name, type, stamp, false, dedup.opts->hash_all, ce);
+		job->size_leader = true;
+		dedup.sizes.emplace(stamp.size, fs_size { job, std::string() });
+	} else {
+		job = &queue.push(p, name, type, stamp, false, true, ce);
+		if (size->second.leader != nullptr)
+			size->second.leader->want_hash.store(true, std::memory_order_relaxed);
+	}
+
+	if (e.linked) {
+		job->inode_leader = true;
+		dedup.inodes.emplace(std::make_pair(stamp.dev, stamp.ino), fs_inode {});
+	}
+
+	fs_merge(queue, dedup);
+}
+
+typedef std::vector<std::pair<struct fs_dir *, size_t>> fs_stack;
+
+// Queues the directories the producer will need next first
+static void fs_prefetch_stack(work_queue<fs_job> &queue, struct fs_walk &walk, fs_stack &stack)
+{
+	for (auto s = stack.rbegin(); s != stack.rend(); ++s) {
+		if (!fs_prefetch(queue, walk, *s->first))
 			break;
+	}
+}
+
+// Queues all files below the root of 'walk' in sorted depth-first order
+static void fs_walk_tree(work_queue<fs_job> &queue, struct fs_dedup &dedup,
+			 struct fs_walk &walk, size_t base_len)
+{
+	fs_stack stack;
+
+	fs_queue_dir(queue, walk, *walk.root);
+	stack.emplace_back(walk.root.get(), 0);
+
+	while (!stack.empty()) {
+		struct fs_dir *d = stack.back().first;
+		size_t i = stack.back().second++;
+
+		if (i == 0) {
+			auto listed = [d] { return d->listed.load(std::memory_order_acquire); };
+
+			if (!listed()) {
+				fs_merge(queue, dedup);
+				fs_wait(queue, dedup, listed);
+			}
+
+			if (d->error != 0)
+				throw fs::filesystem_error("Can not read directory", d->error_path,
+							   std::error_code(d->error, std::generic_category()));
+
+			fs_prefetch_stack(queue, walk, stack);
+		}
+
+		if (i == d->entries.size()) {
+			walk.pending.fetch_sub(d->entries.size(), std::memory_order_relaxed);
+			d->entries = std::vector<struct fs_dirent>();
+			stack.pop_back();
+			fs_prefetch_stack(queue, walk, stack);
+			continue;
+		}
+
+		auto &e = d->entries[i];
+
+		if (e.dir != nullptr) {
+			fs_queue_dir(queue, walk, *e.dir);
+			stack.emplace_back(e.dir.get(), 0);
 		} else {
-			fill += r;
-			size -= r;
+			fs_queue_one(queue, dedup, d->path + e.name, base_len, e);
 		}
 	}
+}
+
+static void fs_enumerate(work_queue<fs_job> &queue, struct fs_dedup &dedup,
+			 struct fs_walk &walk, const char *path)
+{
+	std::string p = path;
+	struct stat st;
+
+	if (stat(path, &st) < 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+		throw fs::filesystem_error("File type not supported", path, std::error_code());
+
+	if (S_ISREG(st.st_mode)) {
+		struct fs_dirent e;
+
+		e.type   = classifile(p);
+		e.linked = st.st_nlink > 1;
+		e.stamp  = fs_stamp(st);
+
+		if (e.type != file_type::ignore)
+			fs_queue_one(queue, dedup, p, 0, e);
+	} else {
+		if (*p.rbegin() != '/')
+			p += '/';
+
+		walk.root.reset(new fs_dir(p));
+		fs_walk_tree(queue, dedup, walk, p.length());
+	}
+}
+
+static void fs_counter(result_sink &out, const char *path, const struct scan_options &opts)
+{
+	struct fs_dedup dedup(opts, out);
+	work_queue<fs_job> queue;
+	struct fs_walk walk;
+	worker_pool pool(opts.jobs, [&](unsigned id) {
+		if (opts.io == io_mode::uring)
+			fs_uring_worker(queue, walk, opts.io_depth, opts.hash);
+		else
+			fs_worker(queue, walk, opts.io, opts.hash);
+	});
+
+	if (opts.cache != nullptr)
+		opts.cache->begin_scan(path, fs::is_directory(path));
+
+	try {
+		fs_enumerate(queue, dedup, walk, path);
+	} catch (...) {
+		queue.close();
+		pool.wait();
+		if (opts.cache != nullptr)
+			opts.cache->end_scan(false);
+		throw;
+	}
+
+	queue.close();
+	fs_merge(queue, dedup, true);
+	pool.wait();
+
+	if (opts.cache != nullptr)
+		opts.cache->end_scan(true);
+}
+
+struct git_counts {
+	uint64_t code;
+	uint64_t comment;
+	uint64_t whitespace;
+};
+
+// Counts only depend on the blob and the file type it is counted as
+struct git_blob_key {
+	git_oid oid;
+	file_type type;
+
+	bool operator==(const git_blob_key &o) const
+	{
+		return type == o.type && git_oid_equal(&oid, &o.oid);
+	}
+};
+
+struct git_blob_key_hash {
+	size_t operator()(const git_blob_key &k) const
+	{
+		size_t h;
+
+		memcpy(&h, k.oid.id, sizeof(h));
+
+		return h ^ static_cast<size_t>(k.type);
+	}
+};
+
+/*
+ * State shared by all revisions counted in one run. The repository is
+ * opened once, workers get their own handles because libgit2 objects must
+ * not be shared between threads. The memo holds the counts of all blobs
+ * counted so far.
+ */
+struct git_context {
+	const char *repo_path;
+	git_repository *repo;
+	std::vector<git_repository *> worker_repos;
+	std::unordered_map<git_blob_key, git_counts, git_blob_key_hash> memo;
+
+	git_context(const char *path, unsigned jobs)
+		: repo_path(path), repo(nullptr), worker_repos(jobs, nullptr)
+	{
+		git_libgit2_init();
+	}
+
+	~git_context()
+	{
+		for (auto r : worker_repos)
+			git_repository_free(r);
+
+		git_repository_free(repo);
+		git_libgit2_shutdown();
+	}
+};
+
+static int git_context_open(struct git_context &ctx)
+{
+	if (ctx.repo != nullptr)
+		return 0;
+
+	return git_repository_open(&ctx.repo, ctx.repo_path);
+}
+
+/*
+ * Jobs for blobs which were already counted, or are counted by an earlier
+ * job of the same walk, are never handed to the blob lookup.
+ */
+struct git_job {
+	git_oid oid;
+	file_result fr;
+	struct git_job *link;
+	bool cached;
+	bool valid;
+
+	git_job(std::string path, const git_oid *o, file_type type, bool duplicate,
+		const struct git_counts *counts, struct git_job *l)
+		: oid(*o), fr(path), link(l), cached(false), valid(false)
+	{
+		fr.type      = type;
+		fr.duplicate = duplicate;
+
+		if (counts != nullptr) {
+			fr.code       = counts->code;
+			fr.comment    = counts->comment;
+			fr.whitespace = counts->whitespace;
+			cached        = true;
+			valid         = true;
+		}
+	}
+
+	bool needs_count() const
+	{
+		return link == nullptr && !cached;
+	}
+};
+
+struct git_walk_cb_data {
+	work_queue<git_job> *queue;
+	const blob_cache *cache;
+	const struct git_context *ctx;
+	std::unordered_set<git_blob_key, git_blob_key_hash> seen;
+	std::unordered_map<git_blob_key, struct git_job *, git_blob_key_hash> pending;
+
+	git_walk_cb_data()
+		: queue(nullptr), cache(nullptr), ctx(nullptr)
+	{ }
+};
+
+static std::string git_error_message(void)
+{
+	const git_error *e = giterr_last();
+
+	return e != nullptr ? e->message : "Unknown libgit2 error";
+}
+
+/*
+ * Queues a blob for counting, unless its counts are already known from
+ * the memo, the blob cache or an earlier job.
+ */
+static struct git_job &git_queue_blob(struct git_walk_cb_data *cb_data, std::string path,
+				      const git_oid *oid, file_type type, bool duplicate)
+{
+	struct git_blob_key key = { *oid, type };
+	const struct git_counts *c = nullptr;
+	const struct blob_record *br;
+	struct git_job *link = nullptr;
+	struct git_counts counts;
+
+	auto m = cb_data->ctx->memo.find(key);
+
+	if (m != cb_data->ctx->memo.end()) {
+		c = &m->second;
+	} else if (cb_data->cache != nullptr &&
+		   (br = cb_data->cache->lookup(oid->id, type)) != nullptr) {
+		counts.code       = br->code;
+		counts.comment    = br->comment;
+		counts.whitespace = br->whitespace;
+		c = &counts;
+	} else {
+		auto p = cb_data->pending.find(key);
+
+		if (p != cb_data->pending.end())
+			link = p->second;
+	}
+
+	auto &job = cb_data->queue->push(path, oid, type, duplicate, c, link);
+
+	if (c == nullptr && link == nullptr)
+		cb_data->pending.emplace(key, &job);
+
+	return job;
+}
+
+/*
+ * The tree walk only collects the blobs to count, in walk order. Blob
+ * lookup and counting is done by the workers.
+ */
+static int git_tree_walker(const char *root, const git_tree_entry *entry, void *payload)
+{
+	struct git_walk_cb_data *cb_data = static_cast<struct git_walk_cb_data *>(payload);
+	std::string fname = git_tree_entry_name(entry);
+	const git_oid *oid = git_tree_entry_id(entry);
+	git_otype ot = git_tree_entry_type(entry);
+	struct git_blob_key key;
+	bool duplicate;
+
+	if (ot != GIT_OBJ_BLOB)
+		return 0;
+
+	uint64_t t = stats_now();
+	auto type = classifile(fname);
+
+	stats_time(stats_phase::classify, t);
+
+	if (type == file_type::ignore)
+		return 0;
+
+	// Duplicates are detected by content alone
+	key.oid   = *oid;
+	key.type  = file_type::unknown;
+	duplicate = !cb_data->seen.insert(key).second;
+
+	git_queue_blob(cb_data, std::string(root) + fname, oid, type, duplicate);
+
+	return 0;
+}
+
+static void git_worker(work_queue<git_job> &queue, struct git_context &ctx,
+		       unsigned id, std::string &error_msg)
+{
+	git_repository *&repo = ctx.worker_repos[id];
+	struct git_job *job;
+	const char *buffer;
+	git_blob *blob;
+	size_t size;
+
+	if (repo == nullptr && git_repository_open(&repo, ctx.repo_path) < 0) {
+		error_msg = git_error_message();
+		return;
+	}
+
+	while ((job = queue.get()) != nullptr) {
+		auto handler = get_file_handler(job->fr.type);
+
+		if (!job->needs_count())
+			continue;
+
+		uint64_t t = stats_now();
+
+		if (git_blob_lookup(&blob, repo, &job->oid) < 0) {
+			error_msg = git_error_message();
+			continue;
+		}
+
+		buffer = static_cast<const char *>(git_blob_rawcontent(blob));
+		size   = git_blob_rawsize(blob);
+
+		stats_time(stats_phase::read, t);
+		stats_read(size);
+
+		t = stats_now();
+		handler(job->fr, buffer, size);
+		job->valid = true;
+		stats_time(stats_phase::count, t);
+
+		git_blob_free(blob);
+	}
+}
+
+// Resolves 'rev' to a commit, peeling annotated tags
+static int git_rev_commit(git_oid *oid, git_repository *repo, const char *rev)
+{
+	git_object *head = nullptr;
+	int error;
+
+	error = git_revparse_single(&head, repo, rev);
+	if (error < 0)
+		return error;
+
+	*oid = *git_object_id(head);
+
+	if (git_object_type(head) == GIT_OBJ_TAG) {
+		git_tag *tag;
+
+		error = git_tag_lookup(&tag, repo, oid);
+		if (error == 0) {
+			*oid = *git_tag_target_id(tag);
+			git_tag_free(tag);
+		}
+	}
+
+	git_object_free(head);
+
+	return error;
+}
+
+static int git_rev_tree(git_tree **tree, git_repository *repo, const char *rev)
+{
+	git_commit *commit = nullptr;
+	git_oid oid;
+	int error;
+
+	error = git_rev_commit(&oid, repo, rev);
+	if (error < 0)
+		return error;
+
+	error = git_commit_lookup(&commit, repo, &oid);
+	if (error < 0)
+		return error;
+
+	error = git_commit_tree(tree, commit);
+
+	git_commit_free(commit);
+
+	return error;
+}
+
+static void git_print_errors(const std::vector<std::string> &errors)
+{
+	for (auto &e : errors) {
+		if (!e.empty()) {
+			std::cerr << "Error: " << e << std::endl;
+			break;
+		}
+	}
+}
+
+// Fills in linked jobs and remembers the new counts, after the workers are done
+static void git_finish_jobs(work_queue<git_job> &queue, struct git_context &ctx,
+			    const struct scan_options &opts,
+			    const std::vector<std::string> &errors)
+{
+	for (auto &job : queue.items()) {
+		if (job.link != nullptr) {
+			job.valid = job.link->valid;
+
+			job.fr.code       = job.link->fr.code;
+			job.fr.comment    = job.link->fr.comment;
+			job.fr.whitespace = job.link->fr.whitespace;
+		}
+
+		if (!job.valid || !job.needs_count())
+			continue;
+
+		struct git_counts c = { job.fr.code, job.fr.comment, job.fr.whitespace };
+
+		ctx.memo.emplace(git_blob_key { job.oid, job.fr.type }, c);
+
+		if (opts.blobs != nullptr)
+			opts.blobs->add(job.oid.id, job.fr.type, c.code,
+					c.comment, c.whitespace);
+	}
+
+	git_print_errors(errors);
+}
+
+static void git_count_tree(result_sink &out, git_tree *tree, struct git_context &ctx,
+			   const struct scan_options &opts)
+{
+	// One message per worker, the last one is for the tree walk
+	std::vector<std::string> errors(opts.jobs + 1);
+	struct git_walk_cb_data cb_data;
+	work_queue<git_job> queue;
+	worker_pool pool(opts.jobs, [&](unsigned id) {
+		git_worker(queue, ctx, id, errors[id]);
+	});
+	int error;
+
+	cb_data.queue = &queue;
+	cb_data.cache = opts.blobs;
+	cb_data.ctx   = &ctx;
+
+	// Classification is timed on its own, it runs in this thread only
+	uint64_t t = stats_now();
+	uint64_t classify_ns = stats.phase_ns[static_cast<size_t>(stats_phase::classify)];
+
+	error = git_tree_walk(tree, GIT_TREEWALK_PRE, git_tree_walker, &cb_data);
+	if (error < 0)
+		errors[opts.jobs] = git_error_message();
+
+	classify_ns = stats.phase_ns[static_cast<size_t>(stats_phase::classify)] - classify_ns;
+	stats_add_time(stats_phase::walk, stats_now() - t - classify_ns);
+
+	queue.close();
+	pool.wait();
+
+	t = stats_now();
+	git_finish_jobs(queue, ctx, opts, errors);
+
+	for (auto &job : queue.items()) {
+		char sha1[GIT_OID_HEXSZ + 1];
+
+		if (!job.valid)
+			continue;
+
+		git_oid_tostr(sha1, sizeof(sha1), &job.oid);
+		out.add(job.fr, sha1);
+	}
+
+	stats_time(stats_phase::merge, t);
+}
+
+static void git_counter(result_sink &out, struct git_context &ctx, const char *rev,
+			const struct scan_options &opts)
+{
+	git_tree *tree = nullptr;
+	int error;
+
+	error = git_context_open(ctx);
+	if (error < 0)
+		goto out;
+
+	error = git_rev_tree(&tree, ctx.repo, rev);
+	if (error < 0)
+		goto out;
+
+	git_count_tree(out, tree, ctx, opts);
+
+	git_tree_free(tree);
+out:
+	if (error < 0)
+		std::cerr << "Error: " << git_error_message() << std::endl;
+}
+
+// Arguments like A..B select delta mode, an empty side means HEAD
+static bool git_split_range(const std::string &arg, std::string &from, std::string &to)
+{
+	auto pos = arg.find("..");
+
+	if (pos == std::string::npos)
+		return false;
+
+	from = arg.substr(0, pos);
+	to   = arg.substr(pos + 2);
+
+	if (from.empty())
+		from = "HEAD";
+	if (to.empty())
+		to = "HEAD";
+
+	return true;
+}
+
+static bool git_diff_side(const git_diff_file &f)
+{
+	return !git_oid_iszero(&f.id) &&
+	       (f.mode == GIT_FILEMODE_BLOB || f.mode == GIT_FILEMODE_BLOB_EXECUTABLE ||
+		f.mode == GIT_FILEMODE_LINK);
+}
+
+static struct git_job *git_queue_diff_side(struct git_walk_cb_data *cb_data,
+					   const git_diff_file &f)
+{
+	file_type type;
+
+	if (!git_diff_side(f))
+		return nullptr;
+
+	type = classifile(f.path);
+	if (type == file_type::ignore || type == file_type::unknown)
+		return nullptr;
+
+	return &git_queue_blob(cb_data, f.path, &f.id, type, false);
+}
+
+// A file modified in place, its changed lines are counted after a diff
+struct git_line_diff {
+	const struct git_job *o;
+	const struct git_job *n;
+	struct file_result added;
+	struct file_result removed;
+	bool valid;
+
+	git_line_diff(const struct git_job *old_job, const struct git_job *new_job)
+		: o(old_job), n(new_job), added(new_job->fr.name),
+		  removed(old_job->fr.name), valid(false)
+	{ }
+};
+
+// Collects removed lines into bufs[0] and added lines into bufs[1]
+static int git_diff_line_collect(const git_diff_delta *delta, const git_diff_hunk *hunk,
+				 const git_diff_line *line, void *payload)
+{
+	std::string *bufs = static_cast<std::string *>(payload);
+	std::string *buf;
+
+	if (line->origin == GIT_DIFF_LINE_DELETION)
+		buf = &bufs[0];
+	else if (line->origin == GIT_DIFF_LINE_ADDITION)
+		buf = &bufs[1];
+	else
+		return 0;
+
+	// The counters skip an empty first line, see finish_line()
+	if (buf->empty() && line->content_len > 0 && line->content[0] == '\n')
+		*buf += ' ';
+
+	buf->append(line->content, line->content_len);
+
+	if (line->content_len == 0 || line->content[line->content_len - 1] != '\n')
+		*buf += '\n';
+
+	return 0;
+}
+
+/*
+ * Changed lines are counted on their own, without the lines around them.
+ * A change inside a multi-line comment or string which starts outside
+ * of the change can therefore be counted as code.
+ */
+static void git_line_diff_worker(work_queue<git_line_diff> &queue, struct git_context &ctx,
+				 unsigned id, std::string &error_msg)
+{
+	git_repository *&repo = ctx.worker_repos[id];
+	struct git_line_diff *job;
+	std::string bufs[2];
+
+	if (repo == nullptr && git_repository_open(&repo, ctx.repo_path) < 0) {
+		error_msg = git_error_message();
+		return;
+	}
+
+	while ((job = queue.get()) != nullptr) {
+		auto handler = get_file_handler(job->n->fr.type);
+		git_blob *old_blob = nullptr, *new_blob = nullptr;
+		int error;
+
+		uint64_t t = stats_now();
+
+		bufs[0].clear();
+		bufs[1].clear();
+
+		error = git_blob_lookup(&old_blob, repo, &job->o->oid);
+		if (error == 0)
+			error = git_blob_lookup(&new_blob, repo, &job->n->oid);
+		if (error == 0)
+			error = git_diff_blobs(old_blob, nullptr, new_blob, nullptr, nullptr,
+					       nullptr, nullptr, nullptr, git_diff_line_collect, bufs);
+
+		git_blob_free(new_blob);
+		git_blob_free(old_blob);
+
+		if (error < 0) {
+			error_msg = git_error_message();
+			continue;
+		}
+
+		stats_time(stats_phase::read, t);
+
+		t = stats_now();
+		handler(job->removed, bufs[0].data(), bufs[0].size());
+		handler(job->added, bufs[1].data(), bufs[1].size());
+		job->valid = true;
+		stats_time(stats_phase::count, t);
+	}
+}
+
+static struct loc_result file_lines(const struct file_result &fr)
+{
+	struct loc_result r;
+
+	r.code       = fr.code;
+	r.comment    = fr.comment;
+	r.whitespace = fr.whitespace;
+
+	return r;
+}
+
+static bool git_delta_in_place(const struct git_job *o, const struct git_job *n)
+{
+	return o != nullptr && n != nullptr && o->fr.type == n->fr.type;
+}
+
+/*
+ * Counts only the blobs which differ between both trees. Files are matched
+ * by path, a rename shows up as a removed and an added file. Added and
+ * removed files count all their lines, files modified in place only the
+ * lines the diff of both blobs shows as added or removed.
+ */
+static void git_count_delta(delta_list &dl, git_tree *from, git_tree *to,
+			    struct git_context &ctx, const struct scan_options &opts)
+{
+	std::vector<std::pair<struct git_job *, struct git_job *>> pairs;
+	std::vector<std::string> errors(opts.jobs);
+	struct git_walk_cb_data cb_data;
+	work_queue<git_job> queue;
+	git_diff *diff = nullptr;
+	int error;
+
+	cb_data.queue = &queue;
+	cb_data.cache = opts.blobs;
+	cb_data.ctx   = &ctx;
+
+	error = git_diff_tree_to_tree(&diff, ctx.repo, from, to, nullptr);
+	if (error < 0) {
+		std::cerr << "Error: " << git_error_message() << std::endl;
+		return;
+	}
+
+	worker_pool pool(opts.jobs, [&](unsigned id) {
+		git_worker(queue, ctx, id, errors[id]);
+	});
+
+	for (size_t i = 0; i < git_diff_num_deltas(diff); ++i) {
+		const git_diff_delta *d = git_diff_get_delta(diff, i);
+		struct git_job *o, *n;
+
+		o = git_queue_diff_side(&cb_data, d->old_file);
+		n = git_queue_diff_side(&cb_data, d->new_file);
+
+		if (o != nullptr || n != nullptr)
+			pairs.emplace_back(o, n);
+	}
+
+	queue.close();
+	pool.wait();
+
+	git_finish_jobs(queue, ctx, opts, errors);
+
+	for (auto &e : errors)
+		e.clear();
+
+	work_queue<git_line_diff> diffs;
+	worker_pool diff_pool(opts.jobs, [&](unsigned id) {
+		git_line_diff_worker(diffs, ctx, id, errors[id]);
+	});
+
+	for (auto &p : pairs) {
+		struct git_job *o = p.first, *n = p.second;
+
+		if (git_delta_in_place(o, n) && o->valid && n->valid)
+			diffs.push(o, n);
+	}
+
+	diffs.close();
+	diff_pool.wait();
+
+	git_print_errors(errors);
+
+	auto next_diff = diffs.items().begin();
+
+	for (auto &p : pairs) {
+		struct git_job *o = p.first, *n = p.second;
+		struct delta_result dr;
+
+		if ((o != nullptr && !o->valid) || (n != nullptr && !n->valid))
+			continue;
+
+		dr.name = n != nullptr ? n->fr.name : o->fr.name;
+
+		if (git_delta_in_place(o, n)) {
+			const struct git_line_diff &d = *next_diff++;
+
+			if (!d.valid)
+				continue;
+
+			dr.status  = delta_status::modified;
+			dr.type    = n->fr.type;
+			dr.added   = file_lines(d.added);
+			dr.removed = file_lines(d.removed);
+			dl.emplace_back(dr);
+			continue;
+		}
+
+		// A file which changed its type is removed and added
+		if (o != nullptr) {
+			dr.status  = delta_status::removed;
+			dr.type    = o->fr.type;
+			dr.added   = loc_result();
+			dr.removed = file_lines(o->fr);
+			dl.emplace_back(dr);
+		}
+
+		if (n != nullptr) {
+			dr.status  = delta_status::added;
+			dr.type    = n->fr.type;
+			dr.added   = file_lines(n->fr);
+			dr.removed = loc_result();
+			dl.emplace_back(dr);
+		}
+	}
+
+	git_diff_free(diff);
+}
+
+static void git_delta(delta_list &dl, struct git_context &ctx, const std::string &from,
+		      const std::string &to, const struct scan_options &opts)
+{
+	git_tree *old_tree = nullptr, *new_tree = nullptr;
+	int error;
+
+	error = git_context_open(ctx);
+	if (error < 0)
+		goto out;
+
+	error = git_rev_tree(&old_tree, ctx.repo, from.c_str());
+	if (error < 0)
+		goto out;
+
+	error = git_rev_tree(&new_tree, ctx.repo, to.c_str());
+	if (error < 0)
+		goto out;
+
+	git_count_delta(dl, old_tree, new_tree, ctx, opts);
+out:
+	if (error < 0)
+		std::cerr << "Error: " << git_error_message() << std::endl;
+
+	git_tree_free(new_tree);
+	git_tree_free(old_tree);
+}
+
+/*
+ * Line counts of a whole tree per file type. Trees are content addressed,
+ * so they are computed once per tree oid and shared by all commits which
+ * contain the same (sub-)tree.
+ */
+using type_totals = std::map<file_type, loc_result>;
+
+struct git_history {
+	std::unordered_map<git_blob_key, type_totals, git_blob_key_hash> trees;
+	std::unordered_set<git_blob_key, git_blob_key_hash> collected;
+};
+
+struct history_row {
+	git_oid commit;
+	git_time_t time;
+	const type_totals *totals;
+};
+
+static git_blob_key git_tree_key(const git_oid *oid)
+{
+	return git_blob_key { *oid, file_type::directory };
+}
+
+// Queues all blobs below trees which were not seen before
+static int git_history_collect(struct git_history &h, struct git_walk_cb_data *cb_data,
+			       git_repository *repo, const git_oid *oid)
+{
+	auto key = git_tree_key(oid);
+	git_tree *tree;
+	int error;
+
+	if (h.trees.find(key) != h.trees.end() || !h.collected.insert(key).second)
+		return 0;
+
+	error = git_tree_lookup(&tree, repo, oid);
+	if (error < 0)
+		return error;
+
+	for (size_t i = 0; i < git_tree_entrycount(tree) && error == 0; ++i) {
+		const git_tree_entry *e = git_tree_entry_byindex(tree, i);
+		git_otype ot = git_tree_entry_type(e);
+
+		if (ot == GIT_OBJ_TREE) {
+			error = git_history_collect(h, cb_data, repo, git_tree_entry_id(e));
+		} else if (ot == GIT_OBJ_BLOB) {
+			auto type = classifile(git_tree_entry_name(e));
+
+			if (type != file_type::ignore)
+				git_queue_blob(cb_data, git_tree_entry_name(e),
+					       git_tree_entry_id(e), type, false);
+		}
+	}
+
+	git_tree_free(tree);
+
+	return error;
+}
+
+static const struct git_counts *git_history_blob(struct git_context &ctx,
+						 const struct scan_options &opts,
+						 const git_oid *oid, file_type type,
+						 struct git_counts &tmp)
+{
+	const struct blob_record *br;
+
+	auto m = ctx.memo.find(git_blob_key { *oid, type });
+	if (m != ctx.memo.end())
+		return &m->second;
+
+	if (opts.blobs == nullptr || (br = opts.blobs->lookup(oid->id, type)) == nullptr)
+		return nullptr;
+
+	tmp.code       = br->code;
+	tmp.comment    = br->comment;
+	tmp.whitespace = br->whitespace;
+
+	return &tmp;
+}
+
+/*
+ * Sums up a tree after all its blobs were counted. Fails when a blob has
+ * no counts because it could not be read, partial totals are never kept.
+ */
+static const type_totals *git_history_tree(struct git_history &h, struct git_context &ctx,
+					   const struct scan_options &opts, const git_oid *oid)
+{
+	auto key = git_tree_key(oid);
+	type_totals totals;
+	git_tree *tree;
+
+	auto t = h.trees.find(key);
+	if (t != h.trees.end())
+		return &t->second;
+
+	if (git_tree_lookup(&tree, ctx.repo, oid) < 0)
+		return nullptr;
+
+	for (size_t i = 0; i < git_tree_entrycount(tree); ++i) {
+		const git_tree_entry *e = git_tree_entry_byindex(tree, i);
+		git_otype ot = git_tree_entry_type(e);
+
+		if (ot == GIT_OBJ_TREE) {
+			auto sub = git_history_tree(h, ctx, opts, git_tree_entry_id(e));
+
+			if (sub == nullptr) {
+				git_tree_free(tree);
+				return nullptr;
+			}
+
+			for (auto &r : *sub)
+				totals[r.first] += r.second;
+		} else if (ot == GIT_OBJ_BLOB) {
+			auto type = classifile(git_tree_entry_name(e));
+			const struct git_counts *c;
+			struct git_counts tmp;
+			loc_result r;
+
+			if (type == file_type::ignore || type == file_type::unknown)
+				continue;
+
+			c = git_history_blob(ctx, opts, git_tree_entry_id(e), type, tmp);
+			if (c == nullptr) {
+				git_tree_free(tree);
+				return nullptr;
+			}
+
+			r.code       = c->code;
+			r.comment    = c->comment;
+			r.whitespace = c->whitespace;
+			r.files      = 1;
+
+			totals[type] += r;
+		}
+	}
+
+	git_tree_free(tree);
+
+	return &h.trees.emplace(key, std::move(totals)).first->second;
+}
+
+// Returns a libgit2 error, or 1 when the error was already reported
+static int git_history_commit(struct git_history &h, struct git_context &ctx,
+			      const struct scan_options &opts, const git_oid *oid,
+			      struct history_row &row)
+{
+	std::vector<std::string> errors(opts.jobs);
+	struct git_walk_cb_data cb_data;
+	work_queue<git_job> queue;
+	git_commit *commit;
+	git_oid tree_oid;
+	int error;
+
+	error = git_commit_lookup(&commit, ctx.repo, oid);
+	if (error < 0)
+		return error;
+
+	row.commit = *oid;
+	row.time   = git_commit_time(commit);
+	tree_oid   = *git_commit_tree_id(commit);
+
+	git_commit_free(commit);
+
+	cb_data.queue = &queue;
+	cb_data.cache = opts.blobs;
+	cb_data.ctx   = &ctx;
+
+	{
+		worker_pool pool(opts.jobs, [&](unsigned id) {
+			git_worker(queue, ctx, id, errors[id]);
+		});
+
+		error = git_history_collect(h, &cb_data, ctx.repo, &tree_oid);
+
+		queue.close();
+		pool.wait();
+	}
+
+	git_finish_jobs(queue, ctx, opts, errors);
+	h.collected.clear();
+
+	if (error < 0)
+		return error;
+
+	row.totals = git_history_tree(h, ctx, opts, &tree_oid);
+	if (row.totals == nullptr) {
+		char sha1[GIT_OID_HEXSZ + 1];
+
+		git_oid_tostr(sha1, sizeof(sha1), oid);
+		std::cerr << "Error: Can not count all files of commit " << sha1 << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Counts every commit in 'range', oldest first. A range without ".." means
+ * all ancestors of that revision.
+ */
+static bool git_history(std::vector<history_row> &rows, struct git_history &h,
+			struct git_context &ctx, const char *range,
+			const struct scan_options &opts)
+{
+	git_revwalk *walk = nullptr;
+	git_oid oid;
+	int error;
+
+	error = git_context_open(ctx);
+	if (error < 0)
+		goto out;
+
+	error = git_revwalk_new(&walk, ctx.repo);
+	if (error < 0)
+		goto out;
+
+	git_revwalk_sorting(walk, GIT_SORT_TOPOLOGICAL | GIT_SORT_REVERSE);
+
+	if (strstr(range, "..") != nullptr) {
+		error = git_revwalk_push_range(walk, range);
+	} else {
+		error = git_rev_commit(&oid, ctx.repo, range);
+		if (error == 0)
+			error = git_revwalk_push(walk, &oid);
+	}
+
+	if (error < 0)
+		goto out;
+
+	while ((error = git_revwalk_next(&oid, walk)) == 0) {
+		struct history_row row;
+
+		error = git_history_commit(h, ctx, opts, &oid, row);
+		if (error != 0)
+			break;
+
+		rows.emplace_back(row);
+	}
+
+	if (error == GIT_ITEROVER)
+		error = 0;
+out:
+	if (error < 0)
+		std::cerr << "Error: " << git_error_message() << std::endl;
+
+	git_revwalk_free(walk);
+
+	return error == 0;
+}
+
+static void print_timing(std::ostream &os, uint64_t t,
+			 uint64_t files, uint64_t lines)
+{
+	uint64_t files_per_msec;
+	uint64_t lines_per_msec;
+
+	// Avoid dividing by zero for scans faster than the timer resolution
+	if (t == 0)
+		t = 1;
+
+	files_per_msec = (files * 10000) / t;
+//	files_per_msec = files_per_msec / 1000;
+
+	lines_per_msec = (lines * 10000) / t;
+//	lines_per_msec = lines_per_msec / 1000;
+
+	os << "  T=";
+	os << t / 1000 << '.';
+	os << std::right << std::setw(3) << std::setfill('0') << t % 1000 << 's';
+	os << std::left;
+	os << std::setw(0) << std::setfill(' ');
+
+	os << " (" << files_per_msec / 10 << '.';
+	os << files_per_msec % 10 << " files/s";
+
+	os << ",  " << lines_per_msec / 10 << '.';
+	os << lines_per_msec % 10 << " lines/s";
+
+	os << ')' << std::endl;
+}
+
+static void print_results_table(const std::map<std::string, loc_result> &results,
+				uint64_t files)
+{
+	uint64_t code = 0, comment = 0, whitespace = 0;
+
+	std::cout << std::left;
+	std::cout << std::setw(20) << " ";
+	std::cout << std::setw(12) << "Files";
+	std::cout << std::setw(12) << "Code";
+	std::cout << std::setw(12) << "Comment";
+	std::cout << std::setw(12) << "Blank" << std::endl;
+
+	std::cout << "  " << std::setw(68) << std::setfill('-') << "" << std::setfill(' ') << std::endl;
+
+	for (auto &ft : results) {
+		const auto &type_str = ft.first;
+		const auto &fr = ft.second;
+
+		std::cout << "  " << std::setw(18) << type_str;
+		std::cout << std::setw(12) << fr.files;
+		std::cout << std::setw(12) << fr.code;
+		std::cout << std::setw(12) << fr.comment;
+		std::cout << std::setw(12) << fr.whitespace << std::endl;
+
+		code       += fr.code;
+		comment    += fr.comment;
+		whitespace += fr.whitespace;
+	}
+
+	std::cout << "  " << std::setw(68) << std::setfill('-') << "" << std::setfill(' ') << std::endl;
+
+	std::cout << std::setw(20) << "  Total";
+	std::cout << std::setw(12) << files;
+	std::cout << std::setw(12) << code;
+	std::cout << std::setw(12) << comment;
+	std::cout << std::setw(12) << whitespace << std::endl;
+}
+
+static void print_results_default(std::string arg, const type_summary &sum, struct timing timing)
+{
+	uint64_t lines = 0, files = 0, unique_files = 0;
+	std::map<std::string, loc_result> results;
+	uint64_t t = timing.stop - timing.start;
+
+	for (size_t type = 0; type < sum.types(); ++type) {
+		const loc_result &r = sum.result(type);
+
+		if (static_cast<file_type>(type) == file_type::unknown)
+			continue;
+
+		files += sum.files(type);
+
+		if (r.files == 0)
+			continue;
+
+		unique_files += r.files;
+
+		results[get_file_type_cstr(static_cast<file_type>(type))] += r;
+
+		lines += r.code + r.comment + r.whitespace;
+	}
+
+	std::cout << "Results for " << arg << ":" << std::endl;
+	std::cout << "  Scanned " << unique_files << " unique files (" << files << " total)" << std::endl;
 
-	close(fd);
+	print_timing(std::cout, t, unique_files, lines);
 
-	return size == 0;
+	print_results_table(results, files);
 }
 
-static file_handler get_file_handler(file_type type)
+static std::string delta_str(uint64_t added, uint64_t removed)
 {
-	file_handler fh_default = [](struct file_result &r, const char *buffer, size_t size) {};
-
-	file_handler unknown;
-	switch (type) {
-	case file_type::c:
-	case file_type::c_cpp_header:
-	case file_type::cpp:
-	case file_type::java:
-	case file_type::yacc:
-	case file_type::dts:
-	case file_type::cocci:
-	case file_type::go:
-	case file_type::javascript:
-	case file_type::lex:
-	case file_type::typescript:
-		return count_c;
-	case file_type::assembly:
-		return count_asm;
-	case file_type::python:
-		return count_python;
-	case file_type::perl:
-		return count_perl;
-	case file_type::xml:
-	case file_type::html:
-	case file_type::svg:
-	case file_type::xslt:
-		return count_xml;
-	case file_type::makefile:
-	case file_type::kconfig:
-	case file_type::shell:
-	case file_type::yaml:
-	case file_type::sed:
-	case file_type::awk:
-		return count_shell;
-	case file_type::latex:
-		return count_latex;
-	case file_type::text:
-	case file_type::json:
-		return count_text;
-	case file_type::asn1:
-		return count_asn1;
-	case file_type::rust:
-		return count_rust;
-	case file_type::css:
-		return count_css;
-	case file_type::ruby:
-		return count_ruby;
-	default:
-		return fh_default;
-	}
-}
-
-static std::string hash_buffer(const char *buffer, size_t size)
-{
-	char str[33];
-	struct hash h;
-
-	md4_init(&h);
-	md4_process(&h, buffer, size);
-	md4_finish(&h);
-	md4_to_string(&h, str);
-
-	return std::string(str);
-}
-
-static bool fs_count_one(struct file_result &r,
-			 const fs::directory_entry &p,
-			 std::map<std::string, bool> &seen,
-			 file_buffer &fb)
-{
-	const auto &path = p.path();
-
-	if (!fs::is_regular_file(p))
-		return false;
-
-	auto type    = classifile(path);
-	auto handler = get_file_handler(type);
-	auto size    = fs::file_size(path);
+	return "+" + std::to_string(added) + " -" + std::to_string(removed);
+}
 
-	if (type == file_type::ignore)
-		return false;
+static const char *delta_status_cstr(delta_status s)
+{
+	switch (s) {
+	case delta_status::added:	return "Added";
+	case delta_status::removed:	return "Removed";
+	case delta_status::modified:	return "Modified";
+	}
 
-	r.type = type;
+	return "";
+}
 
-	fb.resize_buffer(size);
+struct type_delta {
+	struct loc_result added;
+	struct loc_result removed;
+	uint64_t files = 0;
+};
 
-	if (read_file_to_buffer(path.c_str(), fb.buffer, size)) {
-		std::string hash = hash_buffer(fb.buffer, size);
-		auto pos = seen.find(hash);
+static void add_delta(struct type_delta &td, const struct delta_result &dr)
+{
+	td.added   += dr.added;
+	td.removed += dr.removed;
+	td.files   += 1;
+}
 
-		if (pos != seen.end())
-			r.duplicate = true;
-		else
-			seen[hash] = true;
+static std::map<std::string, type_delta> delta_by_type(const delta_list &dl, type_delta &total)
+{
+	std::map<std::string, type_delta> results;
 
-		handler(r, fb.buffer, size);
+	for (auto &dr : dl) {
+		add_delta(results[get_file_type_cstr(dr.type)], dr);
+		add_delta(total, dr);
 	}
 
-	return true;
+	return results;
 }
 
-static bool ignore_entry(const fs::directory_entry &e)
+static void print_delta_counts(const struct loc_result &added, const struct loc_result &removed)
 {
-	for (const auto &c : e.path()) {
-		auto s = c.string();
-		if (s[0] == '.' && s != "." && s != "..")
-			return true;
-	}
-
-	return false;
+	std::cout << std::setw(16) << delta_str(added.code, removed.code);
+	std::cout << std::setw(16) << delta_str(added.comment, removed.comment);
+	std::cout << std::setw(16) << delta_str(added.whitespace, removed.whitespace);
 }
 
-static void fs_counter(file_list &fl, const char *path)
+static void print_delta_default(std::string arg, const delta_list &dl, struct timing timing)
 {
-	std::map<std::string, bool> seen;
-	fs::path input = path;
-	file_buffer fb;
+	unsigned status[3] = { 0, 0, 0 };
+	uint64_t t = timing.stop - timing.start;
+	type_delta total;
 
-	if (fs::is_regular_file(input)) {
-		fs::directory_entry entry(input);
-		file_result fr(input.string());
-		if (fs_count_one(fr, entry, seen, fb))
-			fl.emplace_back(std::move(fr));
-	} else if (fs::is_directory(input)) {
-		std::string::size_type base_len;
-		std::string base_path = path;
+	auto results = delta_by_type(dl, total);
 
-		if (*base_path.rbegin() != '/')
-			base_path += '/';
+	for (auto &dr : dl)
+		status[static_cast<unsigned>(dr.status)] += 1;
 
-		base_len = base_path.length();
+	std::cout << "Changes for " << arg << ":" << std::endl;
+	std::cout << "  Changed " << dl.size() << " files (";
+	std::cout << status[static_cast<unsigned>(delta_status::added)] << " added, ";
+	std::cout << status[static_cast<unsigned>(delta_status::removed)] << " removed, ";
+	std::cout << status[static_cast<unsigned>(delta_status::modified)] << " modified)" << std::endl;
 
-		for (auto &p : fs::recursive_directory_iterator(path)) {
-			if (ignore_entry(p) || !fs::is_regular_file(p))
-				continue;
+	print_timing(std::cout, t, dl.size(), 0);
+
+	std::cout << std::left;
 
-			file_result fr(p.path().string().substr(base_len));
-			if (fs_count_one(fr, p, seen, fb))
-				fl.emplace_back(std::move(fr));
+	if (!dl.empty()) {
+		std::cout << "  " << std::setw(10) << "Status";
+		std::cout << std::setw(18) << "Type";
+		std::cout << std::setw(16) << "Code";
+		std::cout << std::setw(16) << "Comment";
+		std::cout << std::setw(16) << "Blank";
+		std::cout << "Name" << std::endl;
+
+		for (auto &dr : dl) {
+			std::cout << "  " << std::setw(10) << delta_status_cstr(dr.status);
+			std::cout << std::setw(18) << get_file_type_cstr(dr.type);
+			print_delta_counts(dr.added, dr.removed);
+			std::cout << dr.name << std::endl;
 		}
-	} else {
-		throw fs::filesystem_error("File type not supported", input, std::error_code());
+
+		std::cout << std::endl;
 	}
-}
 
-struct git_walk_cb_data {
-	git_repository *repo;
-	file_list *fl;
-	std::map<std::string, bool> seen;
+	std::cout << std::setw(20) << " ";
+	std::cout << std::setw(12) << "Files";
+	std::cout << std::setw(16) << "Code";
+	std::cout << std::setw(16) << "Comment";
+	std::cout << std::setw(16) << "Blank" << std::endl;
 
-	git_walk_cb_data()
-		: repo(nullptr), fl(nullptr)
-	{ }
-};
+	std::cout << "  " << std::setw(76) << std::setfill('-') << "" << std::setfill(' ') << std::endl;
 
-static int git_tree_walker(const char *root, const git_tree_entry *entry, void *payload)
-{
-	struct git_walk_cb_data *cb_data = static_cast<struct git_walk_cb_data *>(payload);
-	std::string fname = git_tree_entry_name(entry);
-	const git_oid *oid = git_tree_entry_id(entry);
-	git_otype ot = git_tree_entry_type(entry);
-	file_result fr(fname);
-	const char *buffer;
-	git_blob *blob;
-	char sha1[41];
-	size_t size;
-	int error;
+	for (auto &ft : results) {
+		const auto &type_str = ft.first;
+		const auto &d = ft.second;
 
-	if (ot != GIT_OBJ_BLOB)
-		return 0;
+		std::cout << "  " << std::setw(18) << type_str;
+		std::cout << std::setw(12) << d.files;
+		print_delta_counts(d.added, d.removed);
+		std::cout << std::endl;
+	}
 
-	auto type    = classifile(fname);
-	auto handler = get_file_handler(type);
+	std::cout << "  " << std::setw(76) << std::setfill('-') << "" << std::setfill(' ') << std::endl;
 
-	if (type == file_type::ignore)
-		return 0;
+	std::cout << std::setw(20) << "  Total";
+	std::cout << std::setw(12) << total.files;
+	print_delta_counts(total.added, total.removed);
+	std::cout << std::endl;
+}
 
-	fr.type = type;
+static void delta_json_counts(json_writer &w, const char *key, const struct loc_result &r)
+{
+	w.key(key);
+	w.begin_object();
+	w.member_uint("Code", r.code);
+	w.member_uint("Comment", r.comment);
+	w.member_uint("Blank", r.whitespace);
+	w.end_object();
+}
 
-	git_oid_fmt(sha1, oid);
-	sha1[40] = 0;
-	std::string hash = sha1;
+static void print_delta_json(std::string arg, const delta_list &dl, json_writer &w)
+{
+	type_delta total;
 
-	auto pos = cb_data->seen.find(hash);
-	if (pos != cb_data->seen.end())
-		fr.duplicate = true;
+	auto results = delta_by_type(dl, total);
 
-	cb_data->seen[hash] = true;
+	w.begin_object();
+	w.member_str("Source", arg);
+	w.member_str("Type", "Delta");
 
-	error = git_blob_lookup(&blob, cb_data->repo, oid);
-	if (error < 0)
-		return error;
+	w.key("Results");
+	w.begin_array();
+	for (auto &ft : results) {
+		w.begin_object();
+		w.member_str("Type", ft.first);
+		w.member_uint("Files", ft.second.files);
+		delta_json_counts(w, "Added", ft.second.added);
+		delta_json_counts(w, "Removed", ft.second.removed);
+		w.end_object();
+	}
+	w.end_array();
+
+	w.key("Files");
+	w.begin_array();
+	for (auto &dr : dl) {
+		w.begin_object();
+		w.member_str("Name", dr.name);
+		w.member_str("Status", delta_status_cstr(dr.status));
+		w.member_str("Type", get_file_type_cstr(dr.type));
+		delta_json_counts(w, "Added", dr.added);
+		delta_json_counts(w, "Removed", dr.removed);
+		w.end_object();
+	}
+	w.end_array();
 
-	buffer = static_cast<const char *>(git_blob_rawcontent(blob));
-	size   = git_blob_rawsize(blob);
+	w.end_object();
+}
 
-	handler(fr, buffer, size);
-	cb_data->fl->emplace_back(std::move(fr));
+static loc_result history_total(const type_totals &totals)
+{
+	loc_result total;
 
-	git_blob_free(blob);
+	for (auto &t : totals)
+		total += t.second;
 
-	return 0;
+	return total;
 }
 
-static void git_counter(file_list &fl, const char *repo_path, const char *rev)
+/*
+ * One row per commit with the totals, followed by the code lines of every
+ * language found anywhere in the history.
+ */
+static void print_history_csv(const std::vector<history_row> &rows)
 {
-	struct git_walk_cb_data cb_data;
-	git_repository *repo = nullptr;
-	const git_oid *oid;
-	git_commit *commit;
-	git_object *head;
-	git_tree *tree;
-	int error;
+	std::map<std::string, file_type> types;
+	char sha1[GIT_OID_HEXSZ + 1];
 
-	git_libgit2_init();
+	for (auto &row : rows) {
+		for (auto &t : *row.totals)
+			types.emplace(get_file_type_cstr(t.first), t.first);
+	}
 
-	error = git_repository_open(&repo, repo_path);
-	if (error < 0)
-		goto out;
+	std::cout << "commit,time,files,code,comment,blank";
+	for (auto &t : types)
+		std::cout << ",\"" << t.first << "\"";
+	std::cout << std::endl;
 
-	error = git_revparse_single(&head, repo, rev);
-	if (error < 0)
-		goto out;
+	for (auto &row : rows) {
+		loc_result total = history_total(*row.totals);
 
-	oid = git_object_id(head);
+		git_oid_tostr(sha1, sizeof(sha1), &row.commit);
 
-	if (git_object_type(head) == GIT_OBJ_TAG) {
-		git_tag *tag;
+		std::cout << sha1 << ',' << row.time << ',' << total.files << ',';
+		std::cout << total.code << ',' << total.comment << ',' << total.whitespace;
 
-		error = git_tag_lookup(&tag, repo, oid);
-		if (error < 0)
-			goto out;
+		for (auto &t : types) {
+			auto r = row.totals->find(t.second);
 
-		oid = git_tag_target_id(tag);
+			std::cout << ',' << (r != row.totals->end() ? r->second.code : 0);
+		}
 
-		git_tag_free(tag);
+		std::cout << std::endl;
 	}
+}
 
-	error = git_commit_lookup(&commit, repo, oid);
-	if (error < 0)
-		goto out;
-
-	error = git_commit_tree(&tree, commit);
-	if (error < 0)
-		goto out;
-
-	cb_data.repo = repo;
-	cb_data.fl   = &fl;
+static void print_loc_json(json_writer &w, const loc_result &r)
+{
+	w.member_uint("Files", r.files);
+	w.member_uint("Code", r.code);
+	w.member_uint("Comment", r.comment);
+	w.member_uint("Blank", r.whitespace);
+}
 
-	error = git_tree_walk(tree, GIT_TREEWALK_PRE, git_tree_walker, &cb_data);
-	if (error < 0)
-		goto out;
+static void print_history_json(const std::vector<history_row> &rows, json_writer &w)
+{
+	char sha1[GIT_OID_HEXSZ + 1];
+
+	w.begin_array();
+	for (auto &row : rows) {
+		git_oid_tostr(sha1, sizeof(sha1), &row.commit);
+
+		w.begin_object();
+		w.member_str("Commit", sha1);
+		w.member_sint("Time", row.time);
+
+		w.key("Results");
+		w.begin_array();
+		for (auto &t : *row.totals) {
+			w.begin_object();
+			w.member_str("Type", get_file_type_cstr(t.first));
+			print_loc_json(w, t.second);
+			w.end_object();
+		}
+		w.end_array();
 
-	git_tree_free(tree);
-	git_commit_free(commit);
-	git_object_free(head);
+		w.key("Total");
+		w.begin_object();
+		print_loc_json(w, history_total(*row.totals));
+		w.end_object();
 
-out:
-	if (error < 0) {
-		const git_error *e = giterr_last();
-		std::cerr << "Error: " << e->message << std::endl;
+		w.end_object();
 	}
-
-	git_repository_free(repo);
-	git_libgit2_shutdown();
+	w.end_array();
 }
 
-static void print_timing(std::ostream &os, uint64_t t,
-			 uint32_t files, uint32_t lines)
+static void print_query_dir(const result_file &rf, uint32_t dir, const char *type)
 {
-	uint64_t files_per_msec;
-	uint64_t lines_per_msec;
+	std::map<std::string, loc_result> results;
+	uint64_t files = 0;
 
-	files_per_msec = ((uint64_t)files * 10000) / t;
-//	files_per_msec = files_per_msec / 1000;
+	for (uint32_t t = 0; t < rf.types(); ++t) {
+		const struct rf_result &r = rf.result(dir, t);
+		std::string name(rf.type_name(t));
+		loc_result lr;
 
-	lines_per_msec = ((uint64_t)lines * 10000) / t;
-//	lines_per_msec = lines_per_msec / 1000;
+		if (r.files == 0 || name == get_file_type_cstr(file_type::unknown))
+			continue;
 
-	os << "  T=";
-	os << t / 1000 << '.';
-	os << std::setw(3) << std::setfill('0') << t % 1000 << 's';
-	os << std::setw(0) << std::setfill(' ');
+		if (type != nullptr && name != type)
+			continue;
 
-	os << " (" << files_per_msec / 10 << '.';
-	os << files_per_msec % 10 << " files/s";
+		lr.code       = r.code;
+		lr.comment    = r.comment;
+		lr.whitespace = r.whitespace;
+		lr.files      = r.files;
 
-	os << ",  " << lines_per_msec / 10 << '.';
-	os << lines_per_msec % 10 << " lines/s";
+		results[name] += lr;
+		files         += r.files;
+	}
 
-	os << ')' << std::endl;
+	std::cout << "  " << files << " unique files" << std::endl;
+
+	print_results_table(results, files);
 }
 
-static void print_results_default(std::string arg, file_list &fl, struct timing timing)
+static void print_query_file(const result_file &rf, uint64_t file)
 {
-	uint32_t code = 0, comment = 0, whitespace = 0, files = 0, unique_files = 0;
-	std::map<std::string, type_result> results;
-	uint64_t t = timing.stop - timing.start;
+	const struct rf_file &f = rf.file(file);
+	std::map<std::string, loc_result> results;
+	loc_result &lr = results[std::string(rf.type_name(f.type))];
 
-	for (auto &fr : fl) {
-		if (fr.type == file_type::unknown)
-			continue;
+	lr.code       = f.code;
+	lr.comment    = f.comment;
+	lr.whitespace = f.whitespace;
+	lr.files      = 1;
 
-		files += 1;
+	if (f.flags & RF_FILE_DUPLICATE)
+		std::cout << "  Duplicate of another file" << std::endl;
 
-		if (fr.duplicate)
-			continue;
+	print_results_table(results, 1);
+}
 
-		unique_files += 1;
+static struct option query_options[] = {
+	{ "source",		required_argument,	0, 's' },
+	{ "type",		required_argument,	0, 't' },
+	{ 0,			0,			0, 0   },
+};
 
-		auto &i = results[get_file_type_cstr(fr.type)];
+// flocc query [--source <name>] [--type <type>] <file> [path]
+static int run_query(int argc, char **argv)
+{
+	const char *source = nullptr;
+	const char *type = nullptr;
+	std::string path;
+	result_file rf;
+	bool found = false;
 
-		i.code       += fr.code;
-		i.comment    += fr.comment;
-		i.whitespace += fr.whitespace;
-		i.files      += 1;
+	while (true) {
+		int c, optidx;
 
-		code       += fr.code;
-		comment    += fr.comment;
-		whitespace += fr.whitespace;
+		c = getopt_long(argc, argv, "s:t:", query_options, &optidx);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 's':
+			source = optarg;
+			break;
+		case 't':
+			type = optarg;
+			break;
+		default:
+			std::cerr << "Usage: flocc query [--source <name>] [--type <type>] <file> [path]" << std::endl;
+			return 1;
+		}
 	}
 
-	std::cout << "Results for " << arg << ":" << std::endl;
-	std::cout << "  Scanned " << unique_files << " unique files (" << files << " total)" << std::endl;
+	if (optind != argc - 1 && optind != argc - 2) {
+		std::cerr << "Usage: flocc query [--source <name>] [--type <type>] <file> [path]" << std::endl;
+		return 1;
+	}
 
-	print_timing(std::cout, t, unique_files, code + comment + whitespace);
+	if (!rf.open(argv[optind]))
+		return 1;
 
-	std::cout << std::left;
-	std::cout << std::setw(20) << " ";
-	std::cout << std::setw(12) << "Files";
-	std::cout << std::setw(12) << "Code";
-	std::cout << std::setw(12) << "Comment";
-	std::cout << std::setw(12) << "Blank" << std::endl;
+	if (optind == argc - 2)
+		path = argv[optind + 1];
 
-	std::cout << "  " << std::setw(68) << std::setfill('-') << "" << std::setfill(' ') << std::endl;
+	for (uint32_t s = 0; s < rf.sources(); ++s) {
+		const struct rf_source &src = rf.source(s);
+		std::string name(rf.str(src.name));
+		uint32_t dir;
+		uint64_t file;
 
-	for (auto &ft : results) {
-		const auto &type_str = ft.first;
-		const auto &fr = ft.second;
+		if (source != nullptr && name != source)
+			continue;
 
-		std::cout << "  " << std::setw(18) << type_str;
-		std::cout << std::setw(12) << fr.files;
-		std::cout << std::setw(12) << fr.code;
-		std::cout << std::setw(12) << fr.comment;
-		std::cout << std::setw(12) << fr.whitespace << std::endl;
+		if (!rf.find(src.root, path, dir, file))
+			continue;
+
+		found = true;
+
+		std::cout << "Results for " << name;
+		if (!path.empty())
+			std::cout << ":" << path;
+		std::cout << ":" << std::endl;
+
+		if (file == UINT64_MAX)
+			print_query_dir(rf, dir, type);
+		else
+			print_query_file(rf, file);
 	}
 
-	std::cout << "  " << std::setw(68) << std::setfill('-') << "" << std::setfill(' ') << std::endl;
+	if (!found) {
+		std::cerr << "No results for " << (path.empty() ? "sources" : path.c_str())
+			  << " in " << argv[optind] << std::endl;
+		return 1;
+	}
 
-	std::cout << std::setw(20) << "  Total";
-	std::cout << std::setw(12) << files;
-	std::cout << std::setw(12) << code;
-	std::cout << std::setw(12) << comment;
-	std::cout << std::setw(12) << whitespace << std::endl;
+	return 0;
 }
 
-static void print_results_json(std::string arg, file_list &fl, std::ofstream &os)
+// flocc merge <output> <input>...
+static int run_merge(int argc, char **argv)
 {
-	file_entry root;
+	result_file_writer out;
+
+	if (argc < 3) {
+		std::cerr << "Usage: flocc merge <output> <input>..." << std::endl;
+		return 1;
+	}
+
+	for (int i = 2; i < argc; ++i) {
+		result_file rf;
+
+		if (!rf.open(argv[i]))
+			return 1;
 
-	// Build File-Tree
-	for (auto &fr : fl)
-		insert_file_result(&root, fr);
+		out.add(rf);
+	}
 
-	// Write Json Data
-	root.jsonize(os, arg);
+	return out.write(argv[1]) ? 0 : 1;
 }
 
 static void usage(void)
@@ -505,9 +2271,28 @@ static void usage(void)
 	std::cout << "  --version          Print version information and exit" << std::endl;
 	std::cout << "  --repo, -r <repo>  Path to git-repository to use, implies --git" << std::endl;
 	std::cout << "  --git, -g          Run in git-mode, arguments are interpreted as" << std::endl;
-	std::cout << "                     git-revisions instead of filesystem paths" << std::endl;
+	std::cout << "                     git-revisions instead of filesystem paths," << std::endl;
+	std::cout << "                     A..B counts the changes between A and B" << std::endl;
 	std::cout << "  --json <file>      Write detailed statistics to <file> in JSON format" << std::endl;
+	std::cout << "  --pretty           Indent the JSON output" << std::endl;
+	std::cout << "  --ndjson <file>    Stream one JSON record per file to <file>" << std::endl;
+	std::cout << "  --out-bin <file>   Write the results to <file> in binary format" << std::endl;
+	std::cout << "  --stats[=<file>]   Print time per phase and resource usage," << std::endl;
+	std::cout << "                     or write it to <file> in JSON format" << std::endl;
+	std::cout << "  --history <range>  Print totals for every commit in <range> as CSV," << std::endl;
+	std::cout << "                     or as JSON with --json, implies --git" << std::endl;
+	std::cout << "  --jobs, -j <n>     Use <n> threads to read and count files" << std::endl;
+	std::cout << "  --io <mode>        Read files with sync, mmap or uring (default mmap)" << std::endl;
+	std::cout << "  --io-depth <n>     Keep <n> files in flight per thread with --io=uring" << std::endl;
+	std::cout << "  --lang-file <file> Load additional language definitions from <file>" << std::endl;
+	std::cout << "  --hash <algo>      Detect duplicates with murmur3 or md4 (default murmur3)" << std::endl;
+	std::cout << "  --cache <file>     Keep results of unchanged files in <file> between runs" << std::endl;
 	std::cout << "  --dump-unknown     Dump counts of unknown file extensions" << std::endl;
+	std::cout << std::endl;
+	std::cout << "flocc query [--source <name>] [--type <type>] <file> [path]" << std::endl;
+	std::cout << "  Print the results below [path] from the binary results <file>" << std::endl;
+	std::cout << "flocc merge <output> <input>..." << std::endl;
+	std::cout << "  Combine binary results files into <output>" << std::endl;
 }
 
 static void version(void)
@@ -524,6 +2309,17 @@ enum {
 	OPTION_GIT,
 	OPTION_JSON,
 	OPTION_DUMP_UNKNOWN,
+	OPTION_JOBS,
+	OPTION_IO,
+	OPTION_IO_DEPTH,
+	OPTION_LANG_FILE,
+	OPTION_HASH,
+	OPTION_CACHE,
+	OPTION_HISTORY,
+	OPTION_PRETTY,
+	OPTION_NDJSON,
+	OPTION_OUT_BIN,
+	OPTION_STATS,
 };
 
 static struct option options[] = {
@@ -533,22 +2329,72 @@ static struct option options[] = {
 	{ "git",		no_argument,		0, OPTION_GIT            },
 	{ "json",		required_argument,	0, OPTION_JSON           },
 	{ "dump-unknown",	no_argument,		0, OPTION_DUMP_UNKNOWN   },
+	{ "jobs",		required_argument,	0, OPTION_JOBS           },
+	{ "io",			required_argument,	0, OPTION_IO             },
+	{ "io-depth",		required_argument,	0, OPTION_IO_DEPTH       },
+	{ "lang-file",		required_argument,	0, OPTION_LANG_FILE      },
+	{ "hash",		required_argument,	0, OPTION_HASH           },
+	{ "cache",		required_argument,	0, OPTION_CACHE          },
+	{ "history",		required_argument,	0, OPTION_HISTORY        },
+	{ "pretty",		no_argument,		0, OPTION_PRETTY         },
+	{ "ndjson",		required_argument,	0, OPTION_NDJSON         },
+	{ "out-bin",		required_argument,	0, OPTION_OUT_BIN        },
+	{ "stats",		optional_argument,	0, OPTION_STATS          },
+	{ 0,			0,			0, 0                     },
 };
 
+// Only plain decimal numbers, strtoul() would wrap "-1" around
+static bool parse_jobs(const char *arg, unsigned &jobs)
+{
+	unsigned long n;
+	char *end;
+
+	if (!isdigit(*arg))
+		return false;
+
+	errno = 0;
+	n     = strtoul(arg, &end, 10);
+	if (*end != '\0' || errno != 0 || n == 0 || n > MAX_JOBS)
+		return false;
+
+	jobs = n;
+
+	return true;
+}
+
 int main(int argc, char **argv)
 {
 	const char *json_file = nullptr;
+	const char *ndjson_file = nullptr;
+	const char *bin_file = nullptr;
+	const char *cache_file = nullptr;
+	const char *history = nullptr;
 	std::vector<std::string> args;
+	struct scan_options opts;
+	result_cache cache;
+	blob_cache blobs;
+	std::unique_ptr<git_context> git;
 	bool dump_unknown = false;
+	const char *stats_file = nullptr;
+	bool want_stats = false;
+	type_summary stats_files;
 	const char *repo = ".";
+	uint64_t start;
 	bool use_git = false;
-	std::ofstream json;
-	bool first = true;
+	bool pretty = false;
+	json_writer json;
+	json_writer ndjson;
+	result_file_writer bin;
+
+	if (argc > 1 && !strcmp(argv[1], "query"))
+		return run_query(argc - 1, argv + 1);
+	else if (argc > 1 && !strcmp(argv[1], "merge"))
+		return run_merge(argc - 1, argv + 1);
 
 	while (true) {
 		int c, optidx;
 
-		c = getopt_long(argc, argv, "hgr:", options, &optidx);
+		c = getopt_long(argc, argv, "hgr:j:", options, &optidx);
 		if (c == -1)
 			break;
 
@@ -570,8 +2416,68 @@ int main(int argc, char **argv)
 		case OPTION_JSON:
 			json_file = optarg;
 			break;
+		case OPTION_PRETTY:
+			pretty = true;
+			break;
+		case OPTION_NDJSON:
+			ndjson_file = optarg;
+			opts.hash_all = true;
+			break;
+		case OPTION_OUT_BIN:
+			bin_file = optarg;
+			break;
+		case OPTION_STATS:
+			want_stats = true;
+			stats_file = optarg;
+			stats_enable();
+			break;
 		case OPTION_DUMP_UNKNOWN:
 			dump_unknown = true;
+			record_unknown_exts();
+			break;
+		case OPTION_JOBS:
+		case 'j':
+			if (!parse_jobs(optarg, opts.jobs)) {
+				std::cerr << "Invalid number of jobs: " << optarg
+					  << ", must be 1 to " << MAX_JOBS << std::endl;
+				return 1;
+			}
+			break;
+		case OPTION_IO:
+			if (!strcmp(optarg, "sync")) {
+				opts.io = io_mode::sync;
+			} else if (!strcmp(optarg, "mmap")) {
+				opts.io = io_mode::mmap;
+			} else if (!strcmp(optarg, "uring")) {
+				opts.io = io_mode::uring;
+			} else {
+				std::cerr << "Unknown I/O mode: " << optarg << std::endl;
+				return 1;
+			}
+			break;
+		case OPTION_LANG_FILE:
+			if (!load_lang_file(optarg))
+				return 1;
+			break;
+		case OPTION_IO_DEPTH:
+			opts.io_depth = strtoul(optarg, nullptr, 10);
+			if (opts.io_depth == 0 || opts.io_depth > 4096) {
+				std::cerr << "Invalid I/O depth: " << optarg << std::endl;
+				return 1;
+			}
+			break;
+		case OPTION_CACHE:
+			cache_file = optarg;
+			break;
+		case OPTION_HISTORY:
+			history = optarg;
+			use_git = true;
+			break;
+		case OPTION_HASH:
+			if (!parse_hash_algo(optarg, opts.hash)) {
+				std::cerr << "Unknown hash algorithm: " << optarg << std::endl;
+				return 1;
+			}
 			break;
 		default:
 			std::cerr << "Unknown option" << std::endl;
@@ -583,6 +2489,8 @@ int main(int argc, char **argv)
 	while (optind < argc)
 		args.emplace_back(std::string(argv[optind++]));
 
+	start = stats_now();
+
 	if (args.size() == 0) {
 		if (use_git)
 			args.emplace_back(std::string("HEAD"));
@@ -590,27 +2498,105 @@ int main(int argc, char **argv)
 			args.emplace_back(std::string("."));
 	}
 
+	// Ranges and --history have no tree to write, don't leave an empty file
+	if (bin_file != nullptr) {
+		bool have_tree = false;
+
+		for (auto &a : args) {
+			std::string from, to;
+
+			if (!use_git || !git_split_range(a, from, to))
+				have_tree = true;
+		}
+
+		if (history != nullptr || !have_tree) {
+			std::cerr << "--out-bin needs at least one revision or path, "
+				  << "ranges and --history are not written" << std::endl;
+			return 1;
+		}
+	}
+
+	// Language files and the hash function are part of the cache fingerprint
+	if (cache_file != nullptr && use_git) {
+		if (!blobs.load(cache_file))
+			return 1;
+		opts.blobs = &blobs;
+	} else if (cache_file != nullptr) {
+		if (!cache.load(cache_file, opts.hash))
+			return 1;
+		opts.cache = &cache;
+	}
+
+	if (use_git)
+		git.reset(new git_context(repo, opts.jobs));
+
 	if (json_file != nullptr) {
-		json.open(json_file);
-		if (!json.is_open()) {
+		if (!json.open(json_file, pretty)) {
 			std::cerr << "Can't open json file for writing " << json_file << std::endl;
 			return 1;
 		}
 	}
 
-	if (json_file != nullptr)
-		json << "[";
+	if (ndjson_file != nullptr) {
+		if (!ndjson.open(ndjson_file, false)) {
+			std::cerr << "Can't open ndjson file for writing " << ndjson_file << std::endl;
+			return 1;
+		}
+	}
+
+	if (history != nullptr) {
+		std::vector<history_row> rows;
+		struct git_history h;
+
+		if (!git_history(rows, h, *git, history, opts))
+			return 1;
+
+		if (json_file != nullptr)
+			print_history_json(rows, json);
+		else
+			print_history_csv(rows);
+
+		args.clear();
+	}
+
+	if (json_file != nullptr && history == nullptr)
+		json.begin_array();
 
 	for (auto &a : args) {
+		std::string from, to;
 		struct timing timing;
+		type_summary summary;
 		file_list fl;
+		result_tee both(fl, summary);
+		result_sink &base = json_file != nullptr ? static_cast<result_sink &>(fl) :
+				    bin_file != nullptr ? static_cast<result_sink &>(both) : summary;
+		ndjson_sink records(ndjson, base);
+		result_sink &sink = ndjson_file != nullptr ? records : base;
+		result_tee counted(sink, stats_files);
+		result_sink &out = want_stats ? counted : sink;
+		uint64_t t;
+
+		if (use_git && git_split_range(a, from, to)) {
+			delta_list dl;
+
+			record_start(timing);
+			git_delta(dl, *git, from, to, opts);
+			record_stop(timing);
+
+			if (json_file == nullptr)
+				print_delta_default(a, dl, timing);
+			else
+				print_delta_json(a, dl, json);
+
+			continue;
+		}
 
 		try {
 			record_start(timing);
 			if (use_git)
-				git_counter(fl, repo, a.c_str());
+				git_counter(out, *git, a.c_str(), opts);
 			else
-				fs_counter(fl, a.c_str());
+				fs_counter(out, a.c_str(), opts);
 			record_stop(timing);
 		} catch (const fs::filesystem_error& f) {
 			std::cerr << "Can not access path " << f.path1() << std::endl;
@@ -620,21 +2606,72 @@ int main(int argc, char **argv)
 			continue;
 		}
 
-		if (json_file == nullptr) {
-			print_results_default(a, fl, timing);
-		} else {
-			if (!first)
-				json << ",";
-			first = false;
-			print_results_json(a, fl, json);
+		t = stats_now();
+
+		if (ndjson_file != nullptr)
+			records.finish(a);
+
+		if (json_file == nullptr)
+			print_results_default(a, summary, timing);
+
+		stats_time(stats_phase::output, t);
+
+		if (json_file != nullptr || bin_file != nullptr) {
+			t = stats_now();
+			file_tree tree(fl);
+			stats_time(stats_phase::tree, t);
+
+			t = stats_now();
+			if (json_file != nullptr)
+				tree.jsonize(json, a);
+			if (bin_file != nullptr)
+				bin.add(a, fl, tree);
+			stats_time(stats_phase::output, t);
 		}
 	}
 
-	if (json_file != nullptr)
-		json << "]";
+	uint64_t t = stats_now();
+
+	if (json_file != nullptr && history == nullptr)
+		json.end_array();
+
+	if (json_file != nullptr && !json.close())
+		return 1;
+
+	if (ndjson_file != nullptr && !ndjson.close())
+		return 1;
+
+	if (bin_file != nullptr && !bin.write(bin_file))
+		return 1;
+
+	stats_time(stats_phase::output, t);
+
+	if (want_stats && stats_file == nullptr)
+		stats_print(std::cerr, stats_files, stats_now() - start);
+
+	if (stats_file != nullptr) {
+		json_writer sj;
+
+		if (!sj.open(stats_file, pretty)) {
+			std::cerr << "Can't open stats file for writing " << stats_file << std::endl;
+			return 1;
+		}
+
+		stats_json(sj, stats_files, stats_now() - start);
+		sj.end_record();
+
+		if (!sj.close())
+			return 1;
+	}
 
 	if (dump_unknown)
 		dump_unknown_exts();
 
+	if (opts.cache != nullptr && !cache.save())
+		return 1;
+
+	if (opts.blobs != nullptr && !blobs.save())
+		return 1;
+
 	return 0;
 }
@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#include <cstring>
+
+#include "hash.h"
+#include "md4.h"
+
+bool parse_hash_algo(const char *name, hash_algo &algo)
+{
+	if (strcmp(name, "murmur3") == 0)
+		algo = hash_algo::murmur3;
+	else if (strcmp(name, "md4") == 0)
+		algo = hash_algo::md4;
+	else
+		return false;
+
+	return true;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+
+	return k;
+}
+
+static inline uint64_t load64(const char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+/*
+ * MurmurHash3_x64_128 by Austin Appleby (public domain) with a seed of 0.
+ * Runs at several GB/s, far ahead of the line counters.
+ */
+static content_hash murmur3(const char *data, size_t size)
+{
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	size_t nblocks = size / 16;
+	uint64_t h1 = 0, h2 = 0;
+	uint64_t k1, k2;
+	const char *tail;
+
+	for (size_t i = 0; i < nblocks; ++i) {
+		k1 = load64(data + i * 16);
+		k2 = load64(data + i * 16 + 8);
+
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	tail = data + nblocks * 16;
+	k1   = 0;
+	k2   = 0;
+
+	switch (size & 15) {
+	case 15: k2 ^= uint64_t(uint8_t(tail[14])) << 48;	/* Fall-through */
+	case 14: k2 ^= uint64_t(uint8_t(tail[13])) << 40;	/* Fall-through */
+	case 13: k2 ^= uint64_t(uint8_t(tail[12])) << 32;	/* Fall-through */
+	case 12: k2 ^= uint64_t(uint8_t(tail[11])) << 24;	/* Fall-through */
+	case 11: k2 ^= uint64_t(uint8_t(tail[10])) << 16;	/* Fall-through */
+	case 10: k2 ^= uint64_t(uint8_t(tail[ 9])) << 8;	/* Fall-through */
+	case  9: k2 ^= uint64_t(uint8_t(tail[ 8]));
+		 k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		 /* Fall-through */
+	case  8: k1 ^= uint64_t(uint8_t(tail[ 7])) << 56;	/* Fall-through */
+	case  7: k1 ^= uint64_t(uint8_t(tail[ 6])) << 48;	/* Fall-through */
+	case  6: k1 ^= uint64_t(uint8_t(tail[ 5])) << 40;	/* Fall-through */
+	case  5: k1 ^= uint64_t(uint8_t(tail[ 4])) << 32;	/* Fall-through */
+	case  4: k1 ^= uint64_t(uint8_t(tail[ 3])) << 24;	/* Fall-through */
+	case  3: k1 ^= uint64_t(uint8_t(tail[ 2])) << 16;	/* Fall-through */
+	case  2: k1 ^= uint64_t(uint8_t(tail[ 1])) << 8;	/* Fall-through */
+	case  1: k1 ^= uint64_t(uint8_t(tail[ 0]));
+		 k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= size;
+	h2 ^= size;
+
+	h1 += h2;
+	h2 += h1;
+
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+
+	h1 += h2;
+	h2 += h1;
+
+	return content_hash { h1, h2 };
+}
+
+static content_hash md4(const char *data, size_t size)
+{
+	// md4_process() takes 32 bit sizes, but full blocks can be chained
+	const size_t chunk = 1UL << 30;
+	struct hash h;
+
+	md4_init(&h);
+
+	while (size > chunk) {
+		md4_process(&h, data, chunk);
+		data += chunk;
+		size -= chunk;
+	}
+
+	md4_process(&h, data, size);
+	md4_finish(&h);
+
+	return content_hash {
+		h.h[0] | (uint64_t(h.h[1]) << 32),
+		h.h[2] | (uint64_t(h.h[3]) << 32),
+	};
+}
+
+content_hash hash_content(hash_algo algo, const char *buffer, size_t size)
+{
+	switch (algo) {
+	case hash_algo::md4:
+		return md4(buffer, size);
+	case hash_algo::murmur3:
+	default:
+		return murmur3(buffer, size);
+	}
+}
+
+// Both digests are stored little endian, so this is the usual notation
+void content_hash_hex(const content_hash &h, char *out)
+{
+	static const char hex[] = "0123456789abcdef";
+	const uint64_t words[2] = { h.lo, h.hi };
+
+	for (int i = 0; i < 16; ++i) {
+		uint8_t byte = words[i / 8] >> ((i % 8) * 8);
+
+		*out++ = hex[byte >> 4];
+		*out++ = hex[byte & 0xf];
+	}
+
+	*out = '\0';
+}
@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#ifndef __HASH_H
+#define __HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+/*
+ * Hash functions for duplicate detection. They only need to protect against
+ * accidental collisions, so the default is a fast non-cryptographic hash.
+ * MD4 is kept for compatibility.
+ */
+enum class hash_algo {
+	murmur3,
+	md4,
+};
+
+struct content_hash {
+	uint64_t lo;
+	uint64_t hi;
+
+	bool operator==(const content_hash &o) const
+	{
+		return lo == o.lo && hi == o.hi;
+	}
+};
+
+// Digest bytes in hex plus the terminating NUL
+#define CONTENT_HASH_HEX_SIZE	33
+
+bool parse_hash_algo(const char *name, hash_algo &algo);
+content_hash hash_content(hash_algo algo, const char *buffer, size_t size);
+void content_hash_hex(const content_hash &h, char *out);
+
+namespace std {
+	template <>
+	struct hash<content_hash> {
+		size_t operator()(const content_hash &h) const
+		{
+			// The bits are already well mixed
+			return static_cast<size_t>(h.lo);
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,298 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#include <algorithm>
+#include <charconv>
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "json.h"
+#include "stats.h"
+
+json_writer::json_writer()
+	: m_buffer(new char[JSON_BUFFER_SIZE]), m_fill(0), m_fd(-1),
+	  m_pretty(false), m_error(0), m_after_key(false)
+{
+}
+
+json_writer::~json_writer()
+{
+	if (m_fd >= 0)
+		close();
+}
+
+bool json_writer::open(const char *path, bool pretty)
+{
+	m_fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (m_fd < 0)
+		return false;
+
+	m_path   = path;
+	m_pretty = pretty;
+
+	return true;
+}
+
+// Write errors are reported once, when the file is closed
+bool json_writer::close()
+{
+	flush();
+
+	if (::close(m_fd) < 0 && m_error == 0)
+		m_error = errno;
+
+	m_fd = -1;
+
+	if (m_error != 0)
+		std::cerr << "Can't write json file " << m_path << ": " << strerror(m_error) << std::endl;
+
+	return m_error == 0;
+}
+
+void json_writer::flush()
+{
+	const char *data = m_buffer.get();
+	size_t size = m_fill;
+
+	m_fill = 0;
+
+	while (size > 0 && m_error == 0) {
+		stats_syscall(stats_call::write);
+		auto r = ::write(m_fd, data, size);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			m_error = errno;
+			break;
+		}
+
+		data += r;
+		size -= r;
+	}
+}
+
+void json_writer::put_long(std::string_view s)
+{
+	while (!s.empty()) {
+		size_t n = std::min(s.length(), JSON_BUFFER_SIZE - m_fill);
+
+		if (n == 0) {
+			flush();
+			continue;
+		}
+
+		memcpy(m_buffer.get() + m_fill, s.data(), n);
+		m_fill += n;
+		s.remove_prefix(n);
+	}
+}
+
+void json_writer::indent()
+{
+	put('\n');
+	for (size_t i = 0; i < m_empty.size(); ++i)
+		put("  ");
+}
+
+// Length of the valid UTF-8 sequence at 's', or 0 if there is none
+static size_t utf8_length(const unsigned char *s, size_t n)
+{
+	uint32_t cp;
+	size_t len;
+
+	if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+		len = 2;
+		cp  = s[0] & 0x1f;
+	} else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+		len = 3;
+		cp  = s[0] & 0x0f;
+	} else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+		len = 4;
+		cp  = s[0] & 0x07;
+	} else {
+		return 0;
+	}
+
+	if (len > n)
+		return 0;
+
+	for (size_t i = 1; i < len; ++i) {
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+		cp = (cp << 6) | (s[i] & 0x3f);
+	}
+
+	// Overlong forms, surrogates and code points beyond Unicode
+	if ((len == 3 && cp < 0x800) || (cp >= 0xd800 && cp <= 0xdfff) ||
+	    (len == 4 && (cp < 0x10000 || cp > 0x10ffff)))
+		return 0;
+
+	return len;
+}
+
+// Bytes which can not be copied to a JSON string as they are
+static const struct escape_table {
+	bool special[256];
+
+	constexpr escape_table() : special()
+	{
+		for (int c = 0; c < 256; ++c)
+			special[c] = c < 0x20 || c >= 0x80 || c == '"' || c == '\\';
+	}
+} escape;
+
+/*
+ * File names are arbitrary bytes. Quotes, backslashes and control
+ * characters are escaped, bytes which are not valid UTF-8 are replaced
+ * with U+FFFD, so that the output is always valid JSON.
+ */
+void json_writer::put_escaped(std::string_view s)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p = reinterpret_cast<const unsigned char *>(s.data());
+	size_t n = s.length(), i = 0;
+
+	put('"');
+
+	while (i < n) {
+		size_t start = i;
+
+		while (i < n && !escape.special[p[i]])
+			i += 1;
+
+		put(s.substr(start, i - start));
+
+		if (i == n)
+			break;
+
+		if (p[i] >= 0x80) {
+			size_t len = utf8_length(p + i, n - i);
+
+			if (len == 0) {
+				put("\\ufffd");
+				i += 1;
+			} else {
+				put(s.substr(i, len));
+				i += len;
+			}
+			continue;
+		}
+
+		switch (p[i]) {
+		case '"':
+			put("\\\"");
+			break;
+		case '\\':
+			put("\\\\");
+			break;
+		case '\b':
+			put("\\b");
+			break;
+		case '\f':
+			put("\\f");
+			break;
+		case '\n':
+			put("\\n");
+			break;
+		case '\r':
+			put("\\r");
+			break;
+		case '\t':
+			put("\\t");
+			break;
+		default:
+			put("\\u00");
+			put(hex[p[i] >> 4]);
+			put(hex[p[i] & 0xf]);
+			break;
+		}
+
+		i += 1;
+	}
+
+	put('"');
+}
+
+void json_writer::begin_object()
+{
+	element();
+	put('{');
+	m_empty.push_back(1);
+}
+
+void json_writer::end_object()
+{
+	bool empty = m_empty.back();
+
+	m_empty.pop_back();
+	if (!empty && m_pretty)
+		indent();
+	put('}');
+}
+
+void json_writer::begin_array()
+{
+	element();
+	put('[');
+	m_empty.push_back(1);
+}
+
+void json_writer::end_array()
+{
+	bool empty = m_empty.back();
+
+	m_empty.pop_back();
+	if (!empty && m_pretty)
+		indent();
+	put(']');
+}
+
+void json_writer::key(std::string_view k)
+{
+	element();
+	put_escaped(k);
+	put(m_pretty ? ": " : ":");
+	m_after_key = true;
+}
+
+void json_writer::str(std::string_view s)
+{
+	element();
+	put_escaped(s);
+}
+
+void json_writer::uint(uint64_t v)
+{
+	char *p;
+
+	element();
+
+	p = reserve(20);
+	m_fill = std::to_chars(p, p + 20, v).ptr - m_buffer.get();
+}
+
+void json_writer::sint(int64_t v)
+{
+	char *p;
+
+	element();
+
+	p = reserve(20);
+	m_fill = std::to_chars(p, p + 20, v).ptr - m_buffer.get();
+}
+
+void json_writer::boolean(bool v)
+{
+	element();
+	put(v ? "true" : "false");
+}
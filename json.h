@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#ifndef __JSON_H
+#define __JSON_H
+
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define JSON_BUFFER_SIZE	(1024 * 1024)
+
+/*
+ * Streaming JSON emitter. Output is collected in a large buffer which is
+ * handed to write() whenever it fills up. Separators between elements are
+ * inserted automatically and strings are escaped. With 'pretty' the output
+ * is indented by two spaces per level.
+ */
+class json_writer {
+protected:
+	std::unique_ptr<char[]> m_buffer;
+	size_t m_fill;
+	int m_fd;
+	std::string m_path;
+	bool m_pretty;
+	int m_error;		// errno of the first failed write
+	bool m_after_key;
+
+	// One entry per open object or array, 1 until it got an element
+	std::vector<uint8_t> m_empty;
+
+	void indent();
+	void put_long(std::string_view s);
+	void put_escaped(std::string_view s);
+
+	char *reserve(size_t n)
+	{
+		if (m_fill + n > JSON_BUFFER_SIZE)
+			flush();
+
+		return m_buffer.get() + m_fill;
+	}
+
+	void put(char c)
+	{
+		*reserve(1) = c;
+		m_fill += 1;
+	}
+
+	void put(std::string_view s)
+	{
+		if (m_fill + s.length() > JSON_BUFFER_SIZE) {
+			put_long(s);
+			return;
+		}
+
+		memcpy(m_buffer.get() + m_fill, s.data(), s.length());
+		m_fill += s.length();
+	}
+
+	// Emits what has to go before a new element of the current container
+	void element()
+	{
+		if (m_after_key) {
+			m_after_key = false;
+			return;
+		}
+
+		if (m_empty.empty())
+			return;
+
+		if (!m_empty.back())
+			put(',');
+		m_empty.back() = 0;
+
+		if (m_pretty)
+			indent();
+	}
+
+public:
+	json_writer();
+	~json_writer();
+
+	bool open(const char *path, bool pretty);
+	bool close();
+
+	void begin_object();
+	void end_object();
+	void begin_array();
+	void end_array();
+
+	void key(std::string_view k);
+	void str(std::string_view s);
+	void uint(uint64_t v);
+	void sint(int64_t v);
+	void boolean(bool v);
+
+	// Ends a top-level value, NDJSON streams have one per line
+	void end_record()			{ put('\n'); }
+	void flush();
+
+	void member_str(std::string_view k, std::string_view v)	{ key(k); str(v); }
+	void member_uint(std::string_view k, uint64_t v)	{ key(k); uint(v); }
+	void member_sint(std::string_view k, int64_t v)		{ key(k); sint(v); }
+	void member_bool(std::string_view k, bool v)		{ key(k); boolean(v); }
+};
+
+#endif
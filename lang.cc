@@ -0,0 +1,491 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <deque>
+#include <map>
+
+#include "lang.h"
+
+#define DFA_STATE_MASK	0x3fff
+#define DFA_KIND_SHIFT	14
+#define DFA_MAX_STATES	(DFA_STATE_MASK + 1)
+
+enum line_kind {
+	LINE_NONE,
+	LINE_CODE,
+	LINE_COMMENT,
+	LINE_BLANK,
+};
+
+enum {
+	MODE_BEGIN,
+	MODE_SLCOMMENT,
+	MODE_MLCOMMENT,	// One mode per multi-line comment, then one per string
+};
+
+static std::vector<lang_dfa> lang_dfas;
+
+lang_def::lang_def()
+	: strings("\""), escape('\\')
+{
+}
+
+/*
+ * Counter state while building the table. Besides the mode and the flags
+ * of the current line it holds the bytes which might still turn out to be
+ * the start of a comment pattern. Stepping this state machine byte by byte
+ * gives the same results as the built-in counters in counters.cc.
+ */
+struct dfa_key {
+	unsigned mode;
+	bool code;
+	bool comment;
+	bool esc;
+	std::string pending;
+
+	bool operator<(const dfa_key &k) const
+	{
+		if (mode != k.mode)
+			return mode < k.mode;
+		if (code != k.code)
+			return code < k.code;
+		if (comment != k.comment)
+			return comment < k.comment;
+		if (esc != k.esc)
+			return esc < k.esc;
+		return pending < k.pending;
+	}
+};
+
+struct dfa_step {
+	const struct lang_def &def;
+	struct dfa_key key;
+	unsigned kind;
+
+	dfa_step(const struct lang_def &d, const struct dfa_key &k)
+		: def(d), key(k), kind(LINE_NONE)
+	{ }
+
+	unsigned string_base() const
+	{
+		return MODE_MLCOMMENT + def.ml_comments.size();
+	}
+
+	// Same as isspace() in the C locale
+	static bool is_space(char c)
+	{
+		return c == ' ' || (c >= '\t' && c <= '\r');
+	}
+
+	void finish_line()
+	{
+		kind = key.code ? LINE_CODE : (key.comment ? LINE_COMMENT : LINE_BLANK);
+	}
+
+	void plain(char c)
+	{
+		if (key.mode == MODE_BEGIN) {
+			auto pos = def.strings.find(c);
+
+			if (pos != std::string::npos) {
+				key.code = true;
+				key.mode = string_base() + pos;
+				key.esc  = false;
+			} else if (c == '\n') {
+				finish_line();
+				key.code = key.comment = false;
+			} else if (!is_space(c) && c != '/') {
+				key.code = true;
+			}
+		} else if (key.mode == MODE_SLCOMMENT) {
+			if (c == '\n') {
+				finish_line();
+				key.code = key.comment = false;
+				key.mode = MODE_BEGIN;
+			}
+		} else if (key.mode < string_base()) {
+			if (c == '\n') {
+				finish_line();
+				key.code    = false;
+				key.comment = true;
+			}
+		} else {
+			if (c == def.strings[key.mode - string_base()] && !key.esc) {
+				key.mode = MODE_BEGIN;
+			} else if (c == '\n') {
+				finish_line();
+				key.comment = false;
+				key.code    = true;
+			}
+			key.esc = (key.mode != MODE_BEGIN && def.escape != 0 && c == def.escape);
+		}
+	}
+
+	/*
+	 * Returns 1 if the pattern matches at the start of the pending bytes,
+	 * 0 if it does not and -1 if more bytes are needed to decide.
+	 */
+	int match(const std::string &pattern, bool eof) const
+	{
+		const auto &p = key.pending;
+
+		if (pattern.size() > p.size())
+			return (!eof && pattern.compare(0, p.size(), p) == 0) ? -1 : 0;
+
+		return p.compare(0, pattern.size(), pattern) == 0 ? 1 : 0;
+	}
+
+	int try_patterns(bool eof)
+	{
+		int r;
+
+		if (key.mode == MODE_BEGIN) {
+			for (size_t i = 0; i < def.ml_comments.size(); ++i) {
+				r = match(def.ml_comments[i].first, eof);
+				if (r < 0)
+					return r;
+				if (r > 0) {
+					key.pending.erase(0, def.ml_comments[i].first.size());
+					key.comment = true;
+					key.mode    = MODE_MLCOMMENT + i;
+					return r;
+				}
+			}
+
+			for (auto &sl : def.sl_comments) {
+				r = match(sl, eof);
+				if (r < 0)
+					return r;
+				if (r > 0) {
+					key.pending.erase(0, sl.size());
+					key.comment = true;
+					key.mode    = MODE_SLCOMMENT;
+					return r;
+				}
+			}
+		} else if (key.mode >= MODE_MLCOMMENT && key.mode < string_base()) {
+			const auto &end = def.ml_comments[key.mode - MODE_MLCOMMENT].second;
+
+			r = match(end, eof);
+			if (r > 0) {
+				key.pending.erase(0, end.size());
+				key.mode = MODE_BEGIN;
+			}
+
+			return r;
+		}
+
+		return 0;
+	}
+
+	void resolve(bool eof)
+	{
+		while (!key.pending.empty()) {
+			int r = try_patterns(eof);
+
+			if (r < 0)
+				return;
+			if (r > 0)
+				continue;
+
+			char c = key.pending[0];
+			key.pending.erase(0, 1);
+			plain(c);
+		}
+	}
+
+	void step(char c)
+	{
+		key.pending += c;
+		resolve(false);
+	}
+
+	// Line kind of an unterminated last line
+	unsigned eof_kind()
+	{
+		resolve(true);
+		finish_line();
+
+		return kind;
+	}
+};
+
+static bool check_pattern(const struct lang_def &def, const std::string &p)
+{
+	if (p.empty() || p.find('\n') != std::string::npos) {
+		std::cerr << "Invalid comment pattern in language " << def.name << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+bool lang_dfa::compile(const struct lang_def &def)
+{
+	std::map<dfa_key, unsigned> ids;
+	std::deque<dfa_key> work;
+	struct dfa_key start;
+
+	for (auto &ml : def.ml_comments) {
+		if (!check_pattern(def, ml.first) || !check_pattern(def, ml.second))
+			return false;
+	}
+
+	for (auto &sl : def.sl_comments) {
+		if (!check_pattern(def, sl))
+			return false;
+	}
+
+	if (def.strings.find('\n') != std::string::npos ||
+	    (def.escape != 0 && def.strings.find(def.escape) != std::string::npos)) {
+		std::cerr << "Invalid string delimiters in language " << def.name << std::endl;
+		return false;
+	}
+
+	start.mode    = MODE_BEGIN;
+	start.code    = false;
+	start.comment = false;
+	start.esc     = false;
+
+	ids[start] = 0;
+	work.push_back(start);
+
+	m_table.clear();
+	m_eof_kind.clear();
+
+	while (!work.empty()) {
+		struct dfa_key key = work.front();
+		unsigned id = ids[key];
+
+		work.pop_front();
+
+		m_table.resize((id + 1) * 256);
+		m_eof_kind.resize(id + 1);
+
+		for (unsigned b = 0; b < 256; ++b) {
+			struct dfa_step s(def, key);
+
+			s.step(static_cast<char>(b));
+
+			auto pos = ids.find(s.key);
+			if (pos == ids.end()) {
+				if (ids.size() == DFA_MAX_STATES) {
+					std::cerr << "Language " << def.name << " is too complex" << std::endl;
+					return false;
+				}
+				pos = ids.emplace(s.key, ids.size()).first;
+				work.push_back(s.key);
+			}
+
+			m_table[id * 256 + b] = pos->second | (s.kind << DFA_KIND_SHIFT);
+		}
+
+		m_eof_kind[id] = dfa_step(def, key).eof_kind();
+	}
+
+	// Bytes which leave a state, states with few of them can be skipped
+	m_skip.resize(ids.size());
+	for (unsigned id = 0; id < ids.size(); ++id) {
+		char bytes[SCAN_SET_SIZE + 1];
+		size_t nr = 0;
+
+		for (unsigned b = 0; b < 256 && nr <= SCAN_SET_SIZE; ++b) {
+			if (m_table[id * 256 + b] != id)
+				bytes[nr++] = static_cast<char>(b);
+		}
+
+		m_skip[id].ok = nr <= SCAN_SET_SIZE && scan_set_init(m_skip[id].set, bytes, nr);
+	}
+
+	return true;
+}
+
+void lang_dfa::count(struct file_result &r, const char *buffer, size_t size) const
+{
+	uint64_t lines[4] = { 0, 0, 0, 0 };
+	const uint16_t *table = m_table.data();
+	unsigned state = 0;
+	size_t index = 0;
+
+	if (size == 0)
+		return;
+
+	// The built-in counters never count an empty first line
+	if (buffer[0] == '\n')
+		index = 1;
+
+	while (index < size) {
+		if (m_skip[state].ok) {
+			index = scan_bytes(buffer, index, size, m_skip[state].set);
+			if (index == size)
+				break;
+		}
+
+		uint16_t e = table[state * 256 + static_cast<unsigned char>(buffer[index++])];
+
+		lines[e >> DFA_KIND_SHIFT] += 1;
+		state = e & DFA_STATE_MASK;
+	}
+
+	if (buffer[size - 1] != '\n')
+		lines[m_eof_kind[state]] += 1;
+
+	r.code       += lines[LINE_CODE];
+	r.comment    += lines[LINE_COMMENT];
+	r.whitespace += lines[LINE_BLANK];
+}
+
+// The tables fully describe how a language is counted
+void lang_dfa::signature(std::string &out) const
+{
+	out.append(reinterpret_cast<const char *>(m_table.data()),
+		   m_table.size() * sizeof(m_table[0]));
+	out.append(reinterpret_cast<const char *>(m_eof_kind.data()),
+		   m_eof_kind.size() * sizeof(m_eof_kind[0]));
+}
+
+static std::vector<std::string> split_words(const std::string &s)
+{
+	std::vector<std::string> words;
+	std::istringstream is(s);
+	std::string w;
+
+	while (is >> w)
+		words.emplace_back(w);
+
+	return words;
+}
+
+static std::string trim(const std::string &s)
+{
+	auto start = s.find_first_not_of(" \t\r");
+	auto end   = s.find_last_not_of(" \t\r");
+
+	if (start == std::string::npos)
+		return std::string();
+
+	return s.substr(start, end - start + 1);
+}
+
+static bool add_lang(const struct lang_def &def)
+{
+	lang_dfa dfa;
+
+	if (def.extensions.empty() && def.filenames.empty()) {
+		std::cerr << "Language " << def.name << " has no extensions or filenames" << std::endl;
+		return false;
+	}
+
+	if (!dfa.compile(def))
+		return false;
+
+	add_user_file_type(def.name, def.extensions, def.filenames);
+	lang_dfas.emplace_back(std::move(dfa));
+
+	return true;
+}
+
+/*
+ * Parses a file with language definitions like:
+ *
+ *   [Name]
+ *   extensions = .ext1 .ext2
+ *   filenames  = Buildfile
+ *   ml_comment = /+ +/ (* *)
+ *   sl_comment = // --
+ *   strings    = " '
+ *   escape     = \
+ *
+ * Empty lines and lines starting with ';' are ignored.
+ */
+bool load_lang_file(const char *path)
+{
+	std::vector<struct lang_def> defs;
+	std::ifstream is(path);
+	unsigned lineno = 0;
+	std::string line;
+
+	if (!is.is_open()) {
+		std::cerr << "Can't open language file " << path << std::endl;
+		return false;
+	}
+
+	while (std::getline(is, line)) {
+		lineno += 1;
+		line = trim(line);
+
+		if (line.empty() || line[0] == ';')
+			continue;
+
+		if (line[0] == '[' && line[line.length() - 1] == ']') {
+			defs.emplace_back();
+			defs.back().name = trim(line.substr(1, line.length() - 2));
+			continue;
+		}
+
+		auto pos = line.find('=');
+		if (pos == std::string::npos || defs.empty()) {
+			std::cerr << path << ":" << lineno << ": Syntax error" << std::endl;
+			return false;
+		}
+
+		auto &def  = defs.back();
+		auto key   = trim(line.substr(0, pos));
+		auto words = split_words(line.substr(pos + 1));
+
+		if (key == "extensions") {
+			for (auto &w : words)
+				def.extensions.emplace_back(w[0] == '.' ? w : "." + w);
+		} else if (key == "filenames") {
+			def.filenames.insert(def.filenames.end(), words.begin(), words.end());
+		} else if (key == "ml_comment" && words.size() % 2 == 0) {
+			for (size_t i = 0; i < words.size(); i += 2)
+				def.ml_comments.emplace_back(words[i], words[i + 1]);
+		} else if (key == "sl_comment") {
+			def.sl_comments.insert(def.sl_comments.end(), words.begin(), words.end());
+		} else if (key == "strings") {
+			def.strings.clear();
+			for (auto &w : words)
+				def.strings += w;
+		} else if (key == "escape" && words.size() <= 1 &&
+			   (words.empty() || words[0].length() == 1)) {
+			def.escape = words.empty() ? 0 : words[0][0];
+		} else {
+			std::cerr << path << ":" << lineno << ": Invalid setting " << key << std::endl;
+			return false;
+		}
+	}
+
+	for (auto &def : defs) {
+		if (!add_lang(def))
+			return false;
+	}
+
+	return true;
+}
+
+std::string lang_signature(void)
+{
+	std::string sig;
+
+	for (auto &dfa : lang_dfas)
+		dfa.signature(sig);
+
+	return sig;
+}
+
+void count_lang(file_type type, struct file_result &r, const char *buffer, size_t size)
+{
+	size_t idx = static_cast<size_t>(type) - static_cast<size_t>(file_type::first_user);
+
+	if (idx < lang_dfas.size())
+		lang_dfas[idx].count(r, buffer, size);
+}
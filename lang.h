@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#ifndef __LANG_H
+#define __LANG_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "classifier.h"
+#include "counters.h"
+#include "scan.h"
+
+/*
+ * Description of a language loaded at runtime. Comment patterns are tried
+ * in order, multi-line comments first, just like the built-in counters do.
+ */
+struct lang_def {
+	std::string name;
+	std::vector<std::string> extensions;
+	std::vector<std::string> filenames;
+	std::vector<std::pair<std::string, std::string>> ml_comments;
+	std::vector<std::string> sl_comments;
+	std::string strings;
+	char escape;
+
+	lang_def();
+};
+
+/*
+ * A lang_def compiled into a byte-indexed transition table. Every entry
+ * holds the next state and the kind of line finished by the transition,
+ * if any. Counting a file is one table lookup per byte, runs of bytes which
+ * do not leave the current state are skipped with scan_bytes().
+ */
+class lang_dfa {
+protected:
+	struct skip {
+		bool ok;
+		struct scan_set set;
+	};
+
+	std::vector<uint16_t> m_table;
+	std::vector<uint8_t>  m_eof_kind;
+	std::vector<skip>     m_skip;
+
+public:
+	bool compile(const struct lang_def &def);
+	void count(struct file_result &r, const char *buffer, size_t size) const;
+	size_t states() const { return m_skip.size(); }
+	void signature(std::string &out) const;
+};
+
+bool load_lang_file(const char *path);
+std::string lang_signature(void);
+void count_lang(file_type type, struct file_result &r, const char *buffer, size_t size);
+
+#endif
@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#include "classifier.h"
+#include "ndjson.h"
+
+ndjson_sink::ndjson_sink(json_writer &w, result_sink &next)
+	: m_w(w), m_next(next), m_flushed(std::chrono::steady_clock::now()), m_pending(false)
+{
+}
+
+void ndjson_sink::add(const struct file_result &fr, std::string_view hash)
+{
+	m_w.begin_object();
+	m_w.member_str("Path", fr.name);
+	m_w.member_str("Type", get_file_type_cstr(fr.type));
+	m_w.member_uint("Code", fr.code);
+	m_w.member_uint("Comment", fr.comment);
+	m_w.member_uint("Blank", fr.whitespace);
+	m_w.member_bool("Duplicate", fr.duplicate);
+	if (!hash.empty())
+		m_w.member_str("Hash", hash);
+	m_w.end_object();
+	m_w.end_record();
+
+	// Consumers may want to work on the records while the scan runs
+	m_pending = true;
+	if (std::chrono::steady_clock::now() - m_flushed > NDJSON_FLUSH_INTERVAL)
+		flush();
+
+	m_summary.add(fr, hash);
+	m_next.add(fr, hash);
+}
+
+void ndjson_sink::flush()
+{
+	if (m_pending)
+		m_w.flush();
+
+	m_pending = false;
+	m_flushed = std::chrono::steady_clock::now();
+
+	m_next.flush();
+}
+
+// Results are per file type like in the JSON tree, duplicates not included
+void ndjson_sink::finish(const std::string &source)
+{
+	uint64_t files = 0;
+	loc_result total;
+
+	for (size_t t = 0; t < m_summary.types(); ++t) {
+		files += m_summary.files(t);
+		total += m_summary.result(t);
+	}
+
+	m_w.begin_object();
+	m_w.member_str("Source", source);
+	m_w.member_str("Type", "Summary");
+	m_w.member_uint("Files", files);
+	m_w.member_uint("Unique", total.files);
+	m_w.member_uint("Code", total.code);
+	m_w.member_uint("Comment", total.comment);
+	m_w.member_uint("Blank", total.whitespace);
+
+	m_w.key("Results");
+	m_w.begin_array();
+	for (size_t t = 0; t < m_summary.types(); ++t) {
+		const loc_result &r = m_summary.result(t);
+
+		if (r.files == 0)
+			continue;
+
+		m_w.begin_object();
+		m_w.member_str("Type", get_file_type_cstr(static_cast<file_type>(t)));
+		m_w.member_uint("Files", r.files);
+		m_w.member_uint("Code", r.code);
+		m_w.member_uint("Comment", r.comment);
+		m_w.member_uint("Blank", r.whitespace);
+		m_w.end_object();
+	}
+	m_w.end_array();
+
+	m_w.end_object();
+	m_w.end_record();
+
+	m_pending = true;
+	flush();
+}
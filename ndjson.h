@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#ifndef __NDJSON_H
+#define __NDJSON_H
+
+#include <string_view>
+#include <chrono>
+#include <string>
+
+#include "filelist.h"
+#include "filetree.h"
+#include "json.h"
+
+// Records are handed to the consumer at least this often
+#define NDJSON_FLUSH_INTERVAL	std::chrono::milliseconds(100)
+
+/*
+ * Writes a JSON record for every file to an NDJSON stream as soon as its
+ * result comes in, and passes the result on to another sink. finish()
+ * closes the records of one scan with a summary record of its totals.
+ */
+class ndjson_sink : public result_sink {
+protected:
+	json_writer &m_w;
+	result_sink &m_next;
+	type_summary m_summary;
+	std::chrono::steady_clock::time_point m_flushed;
+	bool m_pending;
+
+public:
+	ndjson_sink(json_writer &w, result_sink &next);
+
+	void add(const struct file_result &fr, std::string_view hash) override;
+	void flush() override;
+	void finish(const std::string &source);
+};
+
+#endif
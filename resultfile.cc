@@ -0,0 +1,468 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "cache.h"
+#include "classifier.h"
+#include "resultfile.h"
+
+// All arrays start at a multiple of this
+#define RF_ALIGN	8
+
+result_file::result_file()
+	: m_map(nullptr), m_size(0), m_hdr(nullptr), m_types(nullptr),
+	  m_sources(nullptr), m_dirs(nullptr), m_files(nullptr),
+	  m_results(nullptr), m_strings(nullptr)
+{
+}
+
+result_file::~result_file()
+{
+	if (m_map != nullptr)
+		munmap(m_map, m_size);
+}
+
+// Whether 'nr' records of 'size' bytes at 'off' are within the file
+static bool rf_in_bounds(uint64_t off, uint64_t nr, uint64_t size, uint64_t file_size)
+{
+	if (off % RF_ALIGN != 0 || off > file_size)
+		return false;
+
+	return nr <= (file_size - off) / size;
+}
+
+bool result_file::check_string(const struct rf_string &s) const
+{
+	return uint64_t(s.offset) + s.length <= m_hdr->strings_size;
+}
+
+/*
+ * Everything the accessors use is validated once when the file is opened,
+ * so that a damaged file can not make them read outside of the mapping.
+ */
+bool result_file::check() const
+{
+	const struct rf_header *h = m_hdr;
+
+	if (!rf_in_bounds(h->types_off, h->types, sizeof(struct rf_type), m_size) ||
+	    !rf_in_bounds(h->sources_off, h->sources, sizeof(struct rf_source), m_size) ||
+	    !rf_in_bounds(h->dirs_off, h->dirs, sizeof(struct rf_dir), m_size) ||
+	    !rf_in_bounds(h->files_off, h->files, sizeof(struct rf_file), m_size) ||
+	    !rf_in_bounds(h->strings_off, h->strings_size, 1, m_size))
+		return false;
+
+	if (h->types != 0 && h->dirs > UINT64_MAX / h->types)
+		return false;
+
+	if (!rf_in_bounds(h->results_off, uint64_t(h->dirs) * h->types,
+			  sizeof(struct rf_result), m_size))
+		return false;
+
+	for (uint32_t t = 0; t < h->types; ++t) {
+		if (!check_string(m_types[t].name))
+			return false;
+	}
+
+	for (uint32_t s = 0; s < h->sources; ++s) {
+		if (!check_string(m_sources[s].name) || m_sources[s].root >= h->dirs)
+			return false;
+	}
+
+	/*
+	 * Children always come after their parent, anything else could make
+	 * the tree walks loop forever.
+	 */
+	for (uint32_t d = 0; d < h->dirs; ++d) {
+		const struct rf_dir &dir = m_dirs[d];
+
+		if (!check_string(dir.name) || dir.parent >= h->dirs ||
+		    (dir.dirs != 0 && dir.first_dir <= d) ||
+		    uint64_t(dir.first_dir) + dir.dirs > h->dirs ||
+		    dir.first_file > h->files || dir.files > h->files - dir.first_file)
+			return false;
+	}
+
+	for (uint64_t f = 0; f < h->files; ++f) {
+		const struct rf_file &file = m_files[f];
+
+		if (!check_string(file.name) || file.dir >= h->dirs || file.type >= h->types)
+			return false;
+	}
+
+	return true;
+}
+
+bool result_file::open(const char *path)
+{
+	const char *base;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		std::cerr << "Can't open " << path << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(struct rf_header)) {
+		std::cerr << path << " is not a flocc results file" << std::endl;
+		::close(fd);
+		return false;
+	}
+
+	map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+
+	if (map == MAP_FAILED) {
+		std::cerr << "Can't map " << path << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	m_map  = map;
+	m_size = st.st_size;
+	m_hdr  = static_cast<const struct rf_header *>(map);
+	base   = static_cast<const char *>(map);
+
+	if (memcmp(m_hdr->magic, RESULT_FILE_MAGIC, sizeof(m_hdr->magic)) != 0) {
+		std::cerr << path << " is not a flocc results file" << std::endl;
+		return false;
+	}
+
+	if (m_hdr->version != RESULT_FILE_VERSION) {
+		std::cerr << path << " has unsupported version " << m_hdr->version << std::endl;
+		return false;
+	}
+
+	m_types   = reinterpret_cast<const struct rf_type *>(base + m_hdr->types_off);
+	m_sources = reinterpret_cast<const struct rf_source *>(base + m_hdr->sources_off);
+	m_dirs    = reinterpret_cast<const struct rf_dir *>(base + m_hdr->dirs_off);
+	m_files   = reinterpret_cast<const struct rf_file *>(base + m_hdr->files_off);
+	m_results = reinterpret_cast<const struct rf_result *>(base + m_hdr->results_off);
+	m_strings = base + m_hdr->strings_off;
+
+	if (!check()) {
+		std::cerr << path << " is damaged" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Walks 'path' down from directory 'root'. On success 'dir' is the
+ * directory found, or the directory of the file found, and 'file' is the
+ * file index or UINT64_MAX for directories.
+ */
+bool result_file::find(uint32_t root, std::string_view path, uint32_t &dir, uint64_t &file) const
+{
+	dir  = root;
+	file = UINT64_MAX;
+
+	while (!path.empty()) {
+		auto pos = path.find('/');
+		std::string_view name = path.substr(0, pos);
+		const struct rf_dir &d = m_dirs[dir];
+		bool found = false;
+
+		path = pos == std::string_view::npos ? std::string_view() : path.substr(pos + 1);
+
+		// Absolute paths keep "/" as the first directory
+		if (name.empty() && dir == root && pos == 0)
+			name = "/";
+		else if (name.empty() || name == ".")
+			continue;
+
+		auto dirs = m_dirs + d.first_dir;
+		auto dend = dirs + d.dirs;
+		auto dit  = std::lower_bound(dirs, dend, name, [this](const struct rf_dir &a, std::string_view n) {
+			return str(a.name) < n;
+		});
+
+		if (dit != dend && str(dit->name) == name) {
+			dir   = dit - m_dirs;
+			found = true;
+		}
+
+		if (!found && path.empty()) {
+			auto files = m_files + d.first_file;
+			auto fend  = files + d.files;
+			auto fit   = std::lower_bound(files, fend, name, [this](const struct rf_file &a, std::string_view n) {
+				return str(a.name) < n;
+			});
+
+			if (fit != fend && str(fit->name) == name) {
+				file  = fit - m_files;
+				found = true;
+			}
+		}
+
+		if (!found)
+			return false;
+	}
+
+	return true;
+}
+
+result_file_writer::result_file_writer()
+	: m_overflow(false)
+{
+}
+
+struct rf_string result_file_writer::intern(std::string_view s)
+{
+	std::string key(s);
+	auto i = m_string_ids.find(key);
+
+	if (i != m_string_ids.end())
+		return rf_string { i->second, static_cast<uint32_t>(s.length()) };
+
+	if (m_strings.size() + s.length() > UINT32_MAX) {
+		m_overflow = true;
+		return rf_string { 0, 0 };
+	}
+
+	uint32_t offset = m_strings.size();
+
+	m_strings.append(s);
+	m_string_ids.emplace(std::move(key), offset);
+
+	return rf_string { offset, static_cast<uint32_t>(s.length()) };
+}
+
+uint32_t result_file_writer::type_id(std::string_view name)
+{
+	std::string key(name);
+	auto i = m_type_ids.find(key);
+
+	if (i != m_type_ids.end())
+		return i->second;
+
+	uint32_t id = m_types.size();
+
+	m_types.emplace_back(key);
+	m_type_ids.emplace(std::move(key), id);
+
+	return id;
+}
+
+uint32_t result_file_writer::new_dir(std::string_view name, uint32_t parent)
+{
+	struct rf_dir d;
+
+	if (m_dirs.size() >= UINT32_MAX)
+		m_overflow = true;
+
+	memset(&d, 0, sizeof(d));
+	d.name   = intern(name);
+	d.parent = parent;
+
+	m_dirs.push_back(d);
+
+	return m_dirs.size() - 1;
+}
+
+/*
+ * Directories are numbered breadth first, which puts the sub-directories
+ * of every directory next to each other.
+ */
+void result_file_writer::add(const std::string &source, const file_list &fl, const file_tree &tree)
+{
+	std::vector<uint32_t> columns(tree.columns());
+	std::vector<uint32_t> order;	// file_tree ids in the new order
+	std::vector<int> file_types;
+	uint32_t base = m_dirs.size();
+
+	for (size_t c = 0; c < tree.columns(); ++c) {
+		size_t t = static_cast<size_t>(tree.column_type(c));
+
+		columns[c] = type_id(get_file_type_cstr(tree.column_type(c)));
+
+		if (t >= file_types.size())
+			file_types.resize(t + 1, -1);
+		file_types[t] = columns[c];
+	}
+
+	m_sources.push_back(rf_source { intern(source), base, 0 });
+
+	order.push_back(uint32_t(file_list::root_dir));
+	new_dir(std::string_view(), base);
+
+	for (size_t i = 0; i < order.size(); ++i) {
+		const uint64_t *children = tree.children(order[i]);
+		uint32_t id = base + i;
+
+		m_dirs[id].first_dir  = m_dirs.size();
+		m_dirs[id].first_file = m_files.size();
+
+		for (size_t c = 0; c < tree.nr_children(order[i]); ++c) {
+			uint64_t child = children[c];
+
+			if (child & FILE_TREE_FILE) {
+				size_t f = child & ~FILE_TREE_FILE;
+				struct rf_file rf;
+
+				memset(&rf, 0, sizeof(rf));
+				rf.name       = intern(fl.name(f));
+				rf.dir        = id;
+				rf.type       = file_types[static_cast<size_t>(fl.type(f))];
+				rf.flags      = fl.duplicate(f) ? RF_FILE_DUPLICATE : 0;
+				rf.code       = fl.code(f);
+				rf.comment    = fl.comment(f);
+				rf.whitespace = fl.whitespace(f);
+
+				m_files.push_back(rf);
+			} else {
+				new_dir(fl.get_dir(child).name, id);
+				order.push_back(child);
+				m_dirs[id].dirs += 1;
+			}
+		}
+
+		m_dirs[id].files = m_files.size() - m_dirs[id].first_file;
+
+		for (size_t c = 0; c < tree.columns(); ++c) {
+			const loc_result &r = tree.dir_result(order[i], c);
+
+			if (r.files != 0)
+				m_results.push_back(dir_result { id, columns[c],
+					rf_result { r.code, r.comment, r.whitespace, r.files } });
+		}
+	}
+}
+
+// Adds all sources of another results file
+void result_file_writer::add(const result_file &rf)
+{
+	std::vector<uint32_t> columns(rf.types());
+
+	for (uint32_t t = 0; t < rf.types(); ++t)
+		columns[t] = type_id(rf.type_name(t));
+
+	for (uint32_t s = 0; s < rf.sources(); ++s) {
+		const struct rf_source &src = rf.source(s);
+		std::vector<uint32_t> order;
+		uint32_t base = m_dirs.size();
+
+		m_sources.push_back(rf_source { intern(rf.str(src.name)), base, 0 });
+
+		order.push_back(src.root);
+		new_dir(std::string_view(), base);
+
+		for (size_t i = 0; i < order.size(); ++i) {
+			const struct rf_dir &d = rf.dir(order[i]);
+			uint32_t id = base + i;
+
+			m_dirs[id].first_dir  = m_dirs.size();
+			m_dirs[id].dirs       = d.dirs;
+			m_dirs[id].first_file = m_files.size();
+			m_dirs[id].files      = d.files;
+
+			for (uint32_t c = 0; c < d.dirs; ++c) {
+				new_dir(rf.str(rf.dir(d.first_dir + c).name), id);
+				order.push_back(d.first_dir + c);
+			}
+
+			for (uint64_t f = 0; f < d.files; ++f) {
+				struct rf_file file = rf.file(d.first_file + f);
+
+				file.name = intern(rf.str(file.name));
+				file.dir  = id;
+				file.type = columns[file.type];
+
+				m_files.push_back(file);
+			}
+
+			for (uint32_t t = 0; t < rf.types(); ++t) {
+				const struct rf_result &r = rf.result(order[i], t);
+
+				if (r.files != 0)
+					m_results.push_back(dir_result { id, columns[t], r });
+			}
+		}
+	}
+}
+
+static void rf_append(std::string &data, const void *p, size_t size)
+{
+	data.append(static_cast<const char *>(p), size);
+}
+
+static uint64_t rf_align(std::string &data)
+{
+	data.resize((data.size() + RF_ALIGN - 1) & ~uint64_t(RF_ALIGN - 1), '\0');
+
+	return data.size();
+}
+
+bool result_file_writer::write(const char *path)
+{
+	std::vector<struct rf_result> row(m_types.size());
+	struct rf_header hdr;
+	std::string data;
+	size_t r = 0;
+
+	if (m_overflow || m_types.size() > UINT16_MAX) {
+		std::cerr << "Too many results for " << path << std::endl;
+		return false;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, RESULT_FILE_MAGIC, sizeof(hdr.magic));
+	hdr.version      = RESULT_FILE_VERSION;
+	hdr.types        = m_types.size();
+	hdr.sources      = m_sources.size();
+	hdr.dirs         = m_dirs.size();
+	hdr.files        = m_files.size();
+
+	rf_append(data, &hdr, sizeof(hdr));
+
+	hdr.types_off = rf_align(data);
+	for (auto &t : m_types) {
+		struct rf_type rt = { intern(t) };
+
+		rf_append(data, &rt, sizeof(rt));
+	}
+
+	hdr.strings_size = m_strings.size();
+
+	hdr.sources_off = rf_align(data);
+	rf_append(data, m_sources.data(), m_sources.size() * sizeof(struct rf_source));
+
+	hdr.dirs_off = rf_align(data);
+	rf_append(data, m_dirs.data(), m_dirs.size() * sizeof(struct rf_dir));
+
+	hdr.files_off = rf_align(data);
+	rf_append(data, m_files.data(), m_files.size() * sizeof(struct rf_file));
+
+	// Spread the collected results out into one row per directory
+	hdr.results_off = rf_align(data);
+	for (uint32_t d = 0; d < m_dirs.size(); ++d) {
+		std::fill(row.begin(), row.end(), rf_result { 0, 0, 0, 0 });
+
+		for (; r < m_results.size() && m_results[r].dir == d; ++r)
+			row[m_results[r].type] = m_results[r].r;
+
+		rf_append(data, row.data(), row.size() * sizeof(struct rf_result));
+	}
+
+	hdr.strings_off = rf_align(data);
+	rf_append(data, m_strings.data(), m_strings.size());
+
+	memcpy(&data[0], &hdr, sizeof(hdr));
+
+	return write_atomic(path, data);
+}
@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#ifndef __RESULTFILE_H
+#define __RESULTFILE_H
+
+#include <unordered_map>
+#include <string_view>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "filelist.h"
+#include "filetree.h"
+
+/*
+ * Binary results file written with --out-bin. It is made of arrays of
+ * fixed size records in host byte order, which readers use in place from
+ * a read-only mapping:
+ *
+ *   header
+ *   types     Names of the result columns
+ *   sources   One per scanned argument, with its root directory
+ *   dirs      Children of a directory are consecutive and sorted by name
+ *   files     Files of a directory are consecutive and sorted by name
+ *   results   dirs x types results of the unique files below each directory
+ *   strings   Names, every distinct name is stored only once
+ */
+#define RESULT_FILE_MAGIC	"FLOCCRS1"
+#define RESULT_FILE_VERSION	1
+
+#define RF_FILE_DUPLICATE	0x0001
+
+struct rf_string {
+	uint32_t offset;
+	uint32_t length;
+};
+
+struct rf_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t types;
+	uint32_t sources;
+	uint32_t dirs;
+	uint64_t files;
+	uint64_t strings_size;
+	uint64_t types_off;
+	uint64_t sources_off;
+	uint64_t dirs_off;
+	uint64_t files_off;
+	uint64_t results_off;
+	uint64_t strings_off;
+};
+
+struct rf_type {
+	struct rf_string name;
+};
+
+struct rf_source {
+	struct rf_string name;
+	uint32_t root;
+	uint32_t reserved;
+};
+
+// The root directory of a source is its own parent
+struct rf_dir {
+	struct rf_string name;
+	uint32_t parent;
+	uint32_t first_dir;
+	uint32_t dirs;
+	uint32_t reserved;
+	uint64_t first_file;
+	uint64_t files;
+};
+
+struct rf_file {
+	struct rf_string name;
+	uint32_t dir;
+	uint16_t type;
+	uint16_t flags;
+	uint64_t code;
+	uint64_t comment;
+	uint64_t whitespace;
+};
+
+struct rf_result {
+	uint64_t code;
+	uint64_t comment;
+	uint64_t whitespace;
+	uint64_t files;
+};
+
+class result_file {
+protected:
+	void *m_map;
+	size_t m_size;
+	const struct rf_header *m_hdr;
+	const struct rf_type *m_types;
+	const struct rf_source *m_sources;
+	const struct rf_dir *m_dirs;
+	const struct rf_file *m_files;
+	const struct rf_result *m_results;
+	const char *m_strings;
+
+	bool check_string(const struct rf_string &s) const;
+	bool check() const;
+
+public:
+	result_file();
+	~result_file();
+
+	bool open(const char *path);
+
+	uint32_t types() const				{ return m_hdr->types; }
+	uint32_t sources() const			{ return m_hdr->sources; }
+	const struct rf_source &source(uint32_t s) const	{ return m_sources[s]; }
+	const struct rf_dir &dir(uint32_t d) const	{ return m_dirs[d]; }
+	const struct rf_file &file(uint64_t f) const	{ return m_files[f]; }
+
+	std::string_view type_name(uint32_t t) const	{ return str(m_types[t].name); }
+
+	const struct rf_result &result(uint32_t d, uint32_t t) const
+	{
+		return m_results[uint64_t(d) * m_hdr->types + t];
+	}
+
+	std::string_view str(const struct rf_string &s) const
+	{
+		return std::string_view(m_strings + s.offset, s.length);
+	}
+
+	bool find(uint32_t root, std::string_view path, uint32_t &dir, uint64_t &file) const;
+};
+
+/*
+ * Collects the results of scans, or of other results files, and writes
+ * them out as a new results file.
+ */
+class result_file_writer {
+protected:
+	struct dir_result {
+		uint32_t dir;
+		uint32_t type;
+		struct rf_result r;
+	};
+
+	std::vector<std::string> m_types;
+	std::unordered_map<std::string, uint32_t> m_type_ids;
+	std::string m_strings;
+	std::unordered_map<std::string, uint32_t> m_string_ids;
+	std::vector<struct rf_source> m_sources;
+	std::vector<struct rf_dir> m_dirs;
+	std::vector<struct rf_file> m_files;
+	std::vector<struct dir_result> m_results;	// Ordered by directory
+	bool m_overflow;
+
+	struct rf_string intern(std::string_view s);
+	uint32_t type_id(std::string_view name);
+	uint32_t new_dir(std::string_view name, uint32_t parent);
+
+public:
+	result_file_writer();
+
+	void add(const std::string &source, const file_list &fl, const file_tree &tree);
+	void add(const result_file &rf);
+	bool write(const char *path);
+};
+
+#endif
@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "scan.h"
+
+using scan_fn = size_t (*)(const char *, size_t, size_t, const struct scan_set &);
+
+bool scan_set_init(struct scan_set &set, const char *bytes, size_t nr)
+{
+	size_t fill = 0;
+
+	if (nr == 0)
+		return false;
+
+	for (size_t i = 0; i < nr; ++i) {
+		bool found = false;
+
+		for (size_t j = 0; j < fill; ++j)
+			found = found || (set.c[j] == bytes[i]);
+
+		if (found)
+			continue;
+
+		if (fill == SCAN_SET_SIZE)
+			return false;
+
+		set.c[fill++] = bytes[i];
+	}
+
+	while (fill < SCAN_SET_SIZE) {
+		set.c[fill] = set.c[0];
+		fill += 1;
+	}
+
+	return true;
+}
+
+static size_t scan_scalar(const char *buffer, size_t index, size_t size,
+			  const struct scan_set &set)
+{
+	for (; index < size; ++index) {
+		char c = buffer[index];
+
+		if (c == set.c[0] || c == set.c[1] || c == set.c[2] || c == set.c[3])
+			break;
+	}
+
+	return index;
+}
+
+/*
+ * The vector variants never read beyond 'size', the buffer might be a file
+ * mapping which ends at a page boundary. The remaining tail is handled by
+ * the scalar loop.
+ */
+#if defined(__x86_64__)
+
+static size_t scan_sse2(const char *buffer, size_t index, size_t size,
+			const struct scan_set &set)
+{
+	const __m128i v0 = _mm_set1_epi8(set.c[0]);
+	const __m128i v1 = _mm_set1_epi8(set.c[1]);
+	const __m128i v2 = _mm_set1_epi8(set.c[2]);
+	const __m128i v3 = _mm_set1_epi8(set.c[3]);
+
+	for (; index + 16 <= size; index += 16) {
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buffer + index));
+		__m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(d, v0), _mm_cmpeq_epi8(d, v1)),
+					 _mm_or_si128(_mm_cmpeq_epi8(d, v2), _mm_cmpeq_epi8(d, v3)));
+		unsigned mask = _mm_movemask_epi8(m);
+
+		if (mask != 0)
+			return index + __builtin_ctz(mask);
+	}
+
+	return scan_scalar(buffer, index, size, set);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *buffer, size_t index, size_t size,
+			const struct scan_set &set)
+{
+	const __m256i v0 = _mm256_set1_epi8(set.c[0]);
+	const __m256i v1 = _mm256_set1_epi8(set.c[1]);
+	const __m256i v2 = _mm256_set1_epi8(set.c[2]);
+	const __m256i v3 = _mm256_set1_epi8(set.c[3]);
+
+	for (; index + 32 <= size; index += 32) {
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buffer + index));
+		__m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(d, v0), _mm256_cmpeq_epi8(d, v1)),
+					    _mm256_or_si256(_mm256_cmpeq_epi8(d, v2), _mm256_cmpeq_epi8(d, v3)));
+		unsigned mask = _mm256_movemask_epi8(m);
+
+		if (mask != 0)
+			return index + __builtin_ctz(mask);
+	}
+
+	return scan_sse2(buffer, index, size, set);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t scan_avx512(const char *buffer, size_t index, size_t size,
+			  const struct scan_set &set)
+{
+	const __m512i v0 = _mm512_set1_epi8(set.c[0]);
+	const __m512i v1 = _mm512_set1_epi8(set.c[1]);
+	const __m512i v2 = _mm512_set1_epi8(set.c[2]);
+	const __m512i v3 = _mm512_set1_epi8(set.c[3]);
+
+	for (; index + 64 <= size; index += 64) {
+		__m512i d = _mm512_loadu_si512(buffer + index);
+		uint64_t mask = _mm512_cmpeq_epi8_mask(d, v0) | _mm512_cmpeq_epi8_mask(d, v1) |
+				_mm512_cmpeq_epi8_mask(d, v2) | _mm512_cmpeq_epi8_mask(d, v3);
+
+		if (mask != 0)
+			return index + __builtin_ctzll(mask);
+	}
+
+	return scan_avx2(buffer, index, size, set);
+}
+
+static scan_fn select_scan(void)
+{
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512bw"))
+		return scan_avx512;
+	if (__builtin_cpu_supports("avx2"))
+		return scan_avx2;
+
+	return scan_sse2;
+}
+
+#else
+
+static scan_fn select_scan(void)
+{
+	return scan_scalar;
+}
+
+#endif
+
+static const scan_fn scan_impl = select_scan();
+
+size_t scan_bytes(const char *buffer, size_t index, size_t size, const struct scan_set &set)
+{
+	return scan_impl(buffer, index, size, set);
+}
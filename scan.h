@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#ifndef __SCAN_H
+#define __SCAN_H
+
+#include <cstddef>
+
+#define SCAN_SET_SIZE	4
+
+/*
+ * Set of bytes to search for. Unused entries must repeat one of the used
+ * ones, so that all SCAN_SET_SIZE bytes can be compared unconditionally.
+ */
+struct scan_set {
+	char c[SCAN_SET_SIZE];
+};
+
+bool scan_set_init(struct scan_set &set, const char *bytes, size_t nr);
+
+/*
+ * Returns the index of the first byte in buffer[index..size) which is part
+ * of 'set', or 'size' if there is none. Uses the widest vector unit the CPU
+ * supports.
+ */
+size_t scan_bytes(const char *buffer, size_t index, size_t size, const struct scan_set &set);
+
+#endif
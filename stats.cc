@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#include <iomanip>
+#include <cstdlib>
+#include <new>
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include "classifier.h"
+#include "stats.h"
+
+struct stats_counters stats;
+
+static const char *const phase_names[] = {
+	"Walk",
+	"Classify",
+	"Read",
+	"Hash",
+	"Count",
+	"Merge",
+	"Tree",
+	"Output",
+};
+
+static const char *const call_names[] = {
+	"open",
+	"close",
+	"stat",
+	"getdents",
+	"read",
+	"mmap",
+	"munmap",
+	"io_uring_enter",
+	"write",
+};
+
+static_assert(sizeof(phase_names) / sizeof(phase_names[0]) ==
+	      static_cast<size_t>(stats_phase::nr), "phase_names out of sync");
+static_assert(sizeof(call_names) / sizeof(call_names[0]) ==
+	      static_cast<size_t>(stats_call::nr), "call_names out of sync");
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	if (!stats.enabled)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_enable(void)
+{
+	stats.enabled = true;
+}
+
+#ifdef ALLOC_STATS
+// Allocations through operator new, libgit2 and libc are not counted
+void *operator new(size_t size)
+{
+	void *p;
+
+	if (stats.enabled) {
+		stats.allocs.fetch_add(1, std::memory_order_relaxed);
+		stats.alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+	}
+
+	p = malloc(size != 0 ? size : 1);
+	if (p == nullptr)
+		throw std::bad_alloc();
+
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+#endif
+
+static uint64_t peak_rss(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		return 0;
+
+	return ru.ru_maxrss * 1024ULL;
+}
+
+static void print_ns(std::ostream &os, uint64_t ns)
+{
+	os << ns / 1000000 << '.';
+	os << std::right << std::setw(3) << std::setfill('0') << (ns / 1000) % 1000 << " ms";
+	os << std::left << std::setfill(' ') << std::endl;
+}
+
+void stats_print(std::ostream &os, const type_summary &files, uint64_t wall_ns)
+{
+	os << "Statistics:" << std::endl;
+	os << std::left;
+
+	os << "  " << std::setw(18) << "Wall time";
+	print_ns(os, wall_ns);
+
+	// Summed up over all threads, so they can add up to more than wall time
+	for (size_t p = 0; p < static_cast<size_t>(stats_phase::nr); ++p) {
+		os << "  " << std::setw(18) << phase_names[p];
+		print_ns(os, stats.phase_ns[p].load());
+	}
+
+	os << "  " << std::setw(18) << "Bytes read" << stats.bytes_read.load() << std::endl;
+	os << "  " << std::setw(18) << "Bytes hashed" << stats.bytes_hashed.load() << std::endl;
+	os << "  " << std::setw(18) << "Peak RSS" << peak_rss() << " bytes" << std::endl;
+#ifdef ALLOC_STATS
+	os << "  " << std::setw(18) << "Allocations" << stats.allocs.load();
+	os << " (" << stats.alloc_bytes.load() << " bytes)" << std::endl;
+#endif
+
+	os << "  System calls:" << std::endl;
+	for (size_t c = 0; c < static_cast<size_t>(stats_call::nr); ++c)
+		os << "    " << std::setw(16) << call_names[c] << stats.calls[c].load() << std::endl;
+
+	os << "  Files:" << std::endl;
+	for (size_t t = 0; t < files.types(); ++t) {
+		if (files.files(t) == 0)
+			continue;
+
+		os << "    " << std::setw(16) << get_file_type_cstr(static_cast<file_type>(t));
+		os << files.files(t) << std::endl;
+	}
+}
+
+void stats_json(json_writer &w, const type_summary &files, uint64_t wall_ns)
+{
+	w.begin_object();
+	w.key("Statistics");
+	w.begin_object();
+
+	w.member_uint("WallNs", wall_ns);
+
+	w.key("PhaseNs");
+	w.begin_object();
+	for (size_t p = 0; p < static_cast<size_t>(stats_phase::nr); ++p)
+		w.member_uint(phase_names[p], stats.phase_ns[p].load());
+	w.end_object();
+
+	w.member_uint("BytesRead", stats.bytes_read.load());
+	w.member_uint("BytesHashed", stats.bytes_hashed.load());
+	w.member_uint("PeakRSS", peak_rss());
+#ifdef ALLOC_STATS
+	w.member_uint("Allocations", stats.allocs.load());
+	w.member_uint("AllocatedBytes", stats.alloc_bytes.load());
+#endif
+
+	w.key("Syscalls");
+	w.begin_object();
+	for (size_t c = 0; c < static_cast<size_t>(stats_call::nr); ++c)
+		w.member_uint(call_names[c], stats.calls[c].load());
+	w.end_object();
+
+	w.key("Files");
+	w.begin_object();
+	for (size_t t = 0; t < files.types(); ++t) {
+		if (files.files(t) != 0)
+			w.member_uint(get_file_type_cstr(static_cast<file_type>(t)), files.files(t));
+	}
+	w.end_object();
+
+	w.end_object();
+	w.end_object();
+}
@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <iostream>
+#include <cstdint>
+#include <atomic>
+
+#include "filetree.h"
+#include "json.h"
+
+// Phases of a scan, their times are summed up over all threads
+enum class stats_phase {
+	walk,
+	classify,
+	read,
+	hash,
+	count,
+	merge,
+	tree,
+	output,
+	nr,
+};
+
+// System calls made while scanning
+enum class stats_call {
+	open,
+	close,
+	stat,
+	getdents,
+	read,
+	mmap,
+	munmap,
+	uring_enter,
+	write,
+	nr,
+};
+
+/*
+ * Counters for --stats. Nothing is counted unless enabled, so the hot
+ * paths only pay for a test of 'enabled' by default.
+ */
+struct stats_counters {
+	bool enabled;
+	std::atomic<uint64_t> phase_ns[static_cast<size_t>(stats_phase::nr)];
+	std::atomic<uint64_t> calls[static_cast<size_t>(stats_call::nr)];
+	std::atomic<uint64_t> bytes_read;
+	std::atomic<uint64_t> bytes_hashed;
+	std::atomic<uint64_t> allocs;		// Only with ALLOC_STATS
+	std::atomic<uint64_t> alloc_bytes;
+};
+
+extern struct stats_counters stats;
+
+// Monotonic time in nanoseconds, 0 while statistics are disabled
+uint64_t stats_now(void);
+
+void stats_enable(void);
+
+static inline void stats_time(stats_phase p, uint64_t start)
+{
+	if (stats.enabled)
+		stats.phase_ns[static_cast<size_t>(p)].fetch_add(stats_now() - start,
+								 std::memory_order_relaxed);
+}
+
+static inline void stats_add_time(stats_phase p, uint64_t ns)
+{
+	if (stats.enabled)
+		stats.phase_ns[static_cast<size_t>(p)].fetch_add(ns, std::memory_order_relaxed);
+}
+
+static inline void stats_syscall(stats_call c)
+{
+	if (stats.enabled)
+		stats.calls[static_cast<size_t>(c)].fetch_add(1, std::memory_order_relaxed);
+}
+
+static inline void stats_read(uint64_t bytes)
+{
+	if (stats.enabled)
+		stats.bytes_read.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+static inline void stats_hashed(uint64_t bytes)
+{
+	if (stats.enabled)
+		stats.bytes_hashed.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+// 'files' holds the files of all arguments, 'wall_ns' the whole run
+void stats_print(std::ostream &os, const type_summary &files, uint64_t wall_ns);
+void stats_json(json_writer &w, const type_summary &files, uint64_t wall_ns);
+
+#endif
@@ -0,0 +1,328 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "stats.h"
+#include "uring.h"
+
+/*
+ * Reads are limited to 32 bits, leave really large files to the
+ * synchronous reader.
+ */
+#define URING_MAX_READ	(1UL << 30)
+
+enum {
+	OP_OPEN,
+	OP_READ,
+	OP_CLOSE,
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+	return syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+uring_reader::uring_reader(unsigned depth)
+	: m_fd(-1), m_ok(false), m_inflight(0), m_to_submit(0), m_sq_local(0),
+	  m_slots(depth),
+	  m_sq_ring(MAP_FAILED), m_sq_ring_size(0),
+	  m_cq_ring(MAP_FAILED), m_cq_ring_size(0),
+	  m_sqes(static_cast<struct io_uring_sqe *>(MAP_FAILED)), m_sqes_size(0)
+{
+	for (auto &s : m_slots)
+		s.busy = false;
+
+	m_ok = setup(depth * 3);
+}
+
+uring_reader::~uring_reader()
+{
+	if (m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqes_size);
+	if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring)
+		munmap(m_cq_ring, m_cq_ring_size);
+	if (m_sq_ring != MAP_FAILED)
+		munmap(m_sq_ring, m_sq_ring_size);
+	if (m_fd >= 0)
+		close(m_fd);
+}
+
+bool uring_reader::setup(unsigned entries)
+{
+	std::vector<int> files(m_slots.size(), -1);
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+
+	m_fd = io_uring_setup(entries, &p);
+	if (m_fd < 0)
+		return false;
+
+	m_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	m_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (m_cq_ring_size > m_sq_ring_size)
+			m_sq_ring_size = m_cq_ring_size;
+		m_cq_ring_size = m_sq_ring_size;
+	}
+
+	m_sq_ring = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	if (m_sq_ring == MAP_FAILED)
+		return false;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		m_cq_ring = m_sq_ring;
+	} else {
+		m_cq_ring = mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+		if (m_cq_ring == MAP_FAILED)
+			return false;
+	}
+
+	m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	m_sqes = static_cast<struct io_uring_sqe *>(mmap(nullptr, m_sqes_size,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				m_fd, IORING_OFF_SQES));
+	if (m_sqes == MAP_FAILED)
+		return false;
+
+	sq = static_cast<char *>(m_sq_ring);
+	cq = static_cast<char *>(m_cq_ring);
+
+	m_sq_head  = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+	m_sq_tail  = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+	m_sq_mask  = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+	m_sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+	m_cq_head  = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+	m_cq_tail  = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+	m_cq_mask  = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+	m_cqes     = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+	m_sq_local = *m_sq_tail;
+
+	// Sparse table of direct descriptors, one for every slot
+	if (io_uring_register(m_fd, IORING_REGISTER_FILES, files.data(), files.size()) < 0)
+		return false;
+
+	return probe();
+}
+
+// Submits the queued requests and waits for the result of the first one
+bool uring_reader::wait_one(int &res)
+{
+	unsigned head;
+	int ret;
+
+	__atomic_store_n(m_sq_tail, m_sq_local, __ATOMIC_RELEASE);
+
+	do {
+		ret = io_uring_enter(m_fd, m_to_submit, 1, IORING_ENTER_GETEVENTS);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return false;
+
+	m_to_submit = 0;
+
+	head = *m_cq_head;
+	if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+
+	res = m_cqes[head & *m_cq_mask].res;
+	__atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/*
+ * Kernels before 5.15 ignore file_index on open and close. The open then
+ * installs a normal file descriptor which is never closed, the fixed-file
+ * read fails and the close hits descriptor 0. Open a directory into a
+ * direct slot to find out, which only returns 0 when that is supported.
+ */
+bool uring_reader::probe()
+{
+	bool stdin_open = fcntl(0, F_GETFD) >= 0;
+	struct io_uring_sqe *sqe;
+	int res;
+
+	sqe = get_sqe();
+	sqe->opcode     = IORING_OP_OPENAT;
+	sqe->fd         = AT_FDCWD;
+	sqe->addr       = reinterpret_cast<unsigned long>("/");
+	sqe->open_flags = O_RDONLY | O_DIRECTORY;
+	sqe->file_index = 1;
+
+	if (!wait_one(res) || res < 0)
+		return false;
+
+	// A normal descriptor, which might also be 0 when that was free
+	if (res > 0 || (!stdin_open && fcntl(0, F_GETFD) >= 0)) {
+		close(res);
+		return false;
+	}
+
+	sqe = get_sqe();
+	sqe->opcode     = IORING_OP_CLOSE;
+	sqe->file_index = 1;
+
+	return wait_one(res) && res == 0;
+}
+
+struct io_uring_sqe *uring_reader::get_sqe()
+{
+	unsigned idx = m_sq_local++ & *m_sq_mask;
+	struct io_uring_sqe *sqe = &m_sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	m_sq_array[idx] = idx;
+	m_to_submit += 1;
+
+	return sqe;
+}
+
+bool uring_reader::submit(const char *path, size_t size, void *cookie)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (!m_ok || full() || size > URING_MAX_READ)
+		return false;
+
+	for (idx = 0; m_slots[idx].busy; ++idx);
+
+	auto &s = m_slots[idx];
+
+	s.fb.resize_buffer(size);
+	s.cookie   = cookie;
+	s.size     = size;
+	s.open_res = -1;
+	s.read_res = -1;
+	s.pending  = 3;
+	s.busy     = true;
+
+	// Hard links, so that the close always runs and frees the slot
+	sqe = get_sqe();
+	sqe->opcode     = IORING_OP_OPENAT;
+	sqe->flags      = IOSQE_IO_HARDLINK;
+	sqe->fd         = AT_FDCWD;
+	sqe->addr       = reinterpret_cast<unsigned long>(path);
+	sqe->open_flags = O_RDONLY;
+	sqe->file_index = idx + 1;
+	sqe->user_data  = (idx << 2) | OP_OPEN;
+
+	sqe = get_sqe();
+	sqe->opcode    = IORING_OP_READ;
+	sqe->flags     = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+	sqe->fd        = idx;
+	sqe->addr      = reinterpret_cast<unsigned long>(s.fb.buffer);
+	sqe->len       = size;
+	sqe->off       = 0;
+	sqe->user_data = (idx << 2) | OP_READ;
+
+	sqe = get_sqe();
+	sqe->opcode     = IORING_OP_CLOSE;
+	sqe->file_index = idx + 1;
+	sqe->user_data  = (idx << 2) | OP_CLOSE;
+
+	m_inflight += 1;
+
+	return true;
+}
+
+void uring_reader::fail_all(const complete_fn &fn)
+{
+	m_ok = false;
+
+	for (auto &s : m_slots) {
+		if (!s.busy)
+			continue;
+		s.busy = false;
+		m_inflight -= 1;
+		fn(s.cookie, nullptr, false);
+	}
+}
+
+/*
+ * Submits all queued requests and waits until at least one file has been
+ * read completely. The callback runs for every finished file, data is only
+ * valid while the callback runs.
+ */
+void uring_reader::complete(const complete_fn &fn)
+{
+	unsigned head, tail;
+	bool done = false;
+
+	__atomic_store_n(m_sq_tail, m_sq_local, __ATOMIC_RELEASE);
+
+	while (!done && m_inflight > 0) {
+		int ret;
+
+		stats_syscall(stats_call::uring_enter);
+		ret = io_uring_enter(m_fd, m_to_submit, 1, IORING_ENTER_GETEVENTS);
+
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+			fail_all(fn);
+			return;
+		}
+
+		m_to_submit -= (unsigned)ret < m_to_submit ? ret : m_to_submit;
+
+		head = *m_cq_head;
+		tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; ++head) {
+			struct io_uring_cqe *cqe = &m_cqes[head & *m_cq_mask];
+			auto &s = m_slots[cqe->user_data >> 2];
+
+			switch (cqe->user_data & 3) {
+			case OP_OPEN:
+				s.open_res = cqe->res;
+				break;
+			case OP_READ:
+				s.read_res = cqe->res;
+				break;
+			}
+
+			if (--s.pending > 0)
+				continue;
+
+			s.busy = false;
+			m_inflight -= 1;
+			done = true;
+
+			fn(s.cookie, s.fb.buffer,
+			   s.open_res >= 0 && (size_t)s.read_res == s.size);
+		}
+
+		__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+	}
+}
@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#ifndef __URING_H
+#define __URING_H
+
+#include <functional>
+#include <vector>
+
+#include <linux/io_uring.h>
+
+#include "filereader.h"
+
+/*
+ * Batched file reader on top of io_uring. Every file is read by a linked
+ * open/read/close chain of requests which uses a direct descriptor, so no
+ * file descriptor is ever installed into the process. Up to 'depth' chains
+ * are kept in flight at the same time.
+ */
+class uring_reader {
+public:
+	using complete_fn = std::function<void(void *cookie, const char *data, bool ok)>;
+
+protected:
+	struct slot {
+		void *cookie;
+		file_buffer fb;
+		size_t size;
+		int open_res;
+		int read_res;
+		unsigned pending;
+		bool busy;
+	};
+
+	int m_fd;
+	bool m_ok;
+	unsigned m_inflight;
+	unsigned m_to_submit;
+	unsigned m_sq_local;
+	std::vector<slot> m_slots;
+
+	void *m_sq_ring;
+	size_t m_sq_ring_size;
+	void *m_cq_ring;
+	size_t m_cq_ring_size;
+	struct io_uring_sqe *m_sqes;
+	size_t m_sqes_size;
+
+	unsigned *m_sq_head;
+	unsigned *m_sq_tail;
+	unsigned *m_sq_mask;
+	unsigned *m_sq_array;
+	unsigned *m_cq_head;
+	unsigned *m_cq_tail;
+	unsigned *m_cq_mask;
+	struct io_uring_cqe *m_cqes;
+
+	bool setup(unsigned entries);
+	bool wait_one(int &res);
+	bool probe();
+	struct io_uring_sqe *get_sqe();
+	void fail_all(const complete_fn &fn);
+
+public:
+	uring_reader(unsigned depth);
+	~uring_reader();
+
+	bool ok() const { return m_ok; }
+	bool idle() const { return m_inflight == 0; }
+	bool full() const { return m_inflight == m_slots.size(); }
+
+	bool submit(const char *path, size_t size, void *cookie);
+	void complete(const complete_fn &fn);
+};
+
+#endif
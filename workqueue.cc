@@ -0,0 +1,31 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#include "workqueue.h"
+
+worker_pool::worker_pool(unsigned nr, std::function<void(unsigned)> fn)
+{
+	if (nr == 0)
+		nr = 1;
+
+	for (unsigned id = 0; id < nr; ++id)
+		m_threads.emplace_back(fn, id);
+}
+
+worker_pool::~worker_pool()
+{
+	wait();
+}
+
+void worker_pool::wait()
+{
+	for (auto &t : m_threads) {
+		if (t.joinable())
+			t.join();
+	}
+}
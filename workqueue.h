@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Fast Lines of Code Counter
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Jörg Rödel <jroedel@suse.de>
+ */
+#ifndef __WORKQUEUE_H
+#define __WORKQUEUE_H
+
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <deque>
+
+/*
+ * Simple FIFO of work items shared between one producer and a pool of
+ * workers, which may push follow-up items themselves. Only the producer
+ * retires items. Items stay in the queue after they have been handed out, so
+ * that the producer can collect the results in submission order, either
+ * once all workers are done or one by one with front() and pop(). A
+ * std::deque never moves its elements on push_back() or pop_front(), so
+ * the pointers returned by get() stay valid while items are added and
+ * retired.
+ */
+template <typename T>
+class work_queue {
+protected:
+	std::mutex		m_lock;
+	std::condition_variable	m_cond;
+	std::condition_variable	m_done;
+	std::deque<T>		m_items;
+	size_t			m_next;
+	bool			m_closed;
+
+public:
+	work_queue()
+		: m_next(0), m_closed(false)
+	{ }
+
+	// The returned reference stays valid, but workers may already use it
+	template <typename... Args>
+	T &push(Args&&... args)
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		T &item = m_items.emplace_back(std::forward<Args>(args)...);
+		m_cond.notify_one();
+
+		return item;
+	}
+
+	// Called by the producer when no more items will be pushed
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		m_closed = true;
+		m_cond.notify_all();
+	}
+
+	/*
+	 * Returns the next item to work on or nullptr when the queue is drained.
+	 * Without 'wait' it also returns nullptr when no item is available yet.
+	 */
+	T *get(bool wait = true)
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+
+		if (wait)
+			m_cond.wait(lock, [this] { return m_closed || m_next < m_items.size(); });
+
+		if (m_next == m_items.size())
+			return nullptr;
+
+		return &m_items[m_next++];
+	}
+
+	// Called by workers after they finished an item, wakes up wait_for()
+	void signal()
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		m_done.notify_all();
+	}
+
+	// Lets the producer wait for a worker to finish an item
+	template <typename Pred>
+	void wait_for(Pred pred)
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+
+		m_done.wait(lock, pred);
+	}
+
+	// Same as wait_for(), but gives up after 'timeout', returns pred()
+	template <typename Pred, typename Rep, typename Period>
+	bool wait_for(Pred pred, std::chrono::duration<Rep, Period> timeout)
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+
+		return m_done.wait_for(lock, timeout, pred);
+	}
+
+	// Oldest item which was not retired yet, or nullptr
+	T *front()
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		return m_items.empty() ? nullptr : &m_items.front();
+	}
+
+	// Retires front(), which must have been handed out and finished
+	void pop()
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		m_items.pop_front();
+		m_next -= 1;
+	}
+
+	// Number of items which were not retired yet
+	size_t size()
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		return m_items.size();
+	}
+
+	// Only safe to use after all workers have finished
+	std::deque<T> &items()
+	{
+		return m_items;
+	}
+};
+
+class worker_pool {
+protected:
+	std::vector<std::thread> m_threads;
+
+public:
+	worker_pool(unsigned nr, std::function<void(unsigned)> fn);
+	~worker_pool();
+	void wait();
+};
+
+#endif